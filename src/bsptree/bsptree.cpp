@@ -1,6 +1,12 @@
 #include "bsptree.hpp"
+#include "classify.hpp"
 #include "math/vector.hpp"
-#define EPSILON 1e-3
+#include <algorithm>
+#include <cfloat>
+#include <utility>
+#ifdef OPENMP
+#include <omp.h>
+#endif
 #define ASSERT(condition){if(!(condition)){std::cerr<<"ASSERTION FAILED: "<<#condition<<"@"<<__FILE__<<"("<<__LINE__<<")"<<std::endl;}}
 
 
@@ -22,288 +28,2362 @@ Vector3 TreeTriangle::normal(){
   //  ASSERT(length(n)>= 1e-10);
   return normalize(n);
 }
-BSP_tree::BSP_tree():front(NULL), back(NULL), parent(NULL){}
-BSP_tree::BSP_tree(TreeTriangle t):front(NULL), back(NULL), parent(NULL){
-  this->triangle.vertices[0] = Vector3((t.vertices[0])[0], (t.vertices[0])[1], (t.vertices[0])[2]);
-  this->triangle.vertices[1] =  Vector3((t.vertices[1])[0], (t.vertices[1])[1], (t.vertices[1])[2]);
-  this->triangle.vertices[2] = Vector3((t.vertices[2])[0], (t.vertices[2])[1], (t.vertices[2])[2]);
+
+Plane TreeTriangle::plane() const{
+  return Plane(vertices[0], vertices[1], vertices[2]);
+}
+
+Plane::Plane():normal(Vector3::Zero()), d(0.0){}
+Plane::Plane(const Vector3& a, const Vector3& b, const Vector3& c){
+  Vector3 n = cross(b-a, c-b);
+  float len = length(n);
+  //a degenerate triangle gets a zero plane, so every point reads as
+  //coplanar with it instead of propagating NaNs
+  if(len > 0.0)
+    normal = n/len;
+  else
+    normal = Vector3::Zero();
+  d = -dot(normal, a);
+}
+
+Bounds::Bounds():lo(FLT_MAX, FLT_MAX, FLT_MAX), hi(-FLT_MAX, -FLT_MAX, -FLT_MAX){}
+
+void Bounds::include(const Vector3& p){
+  lo = vmin(lo, p);
+  hi = vmax(hi, p);
+}
+
+void Bounds::include(const Bounds& b){
+  lo = vmin(lo, b.lo);
+  hi = vmax(hi, b.hi);
+}
+
+BSP_node::BSP_node():front(BSP_NULL), back(BSP_NULL), parent(BSP_NULL), hidden(false){}
+BSP_node::BSP_node(const Triangle& t, const Plane& plane, unsigned int parent):
+  triangle(t), plane(plane), front(BSP_NULL), back(BSP_NULL), parent(parent), hidden(false){}
+
+BSP_tree::BSP_tree(){}
+BSP_tree::BSP_tree(TreeTriangle t){
+  add(t);
+}
+
+void BSP_tree::reserve(size_t n){
+  nodes.reserve(n);
 }
 
-//f classifies if a point is in front or behind a plane by returning
-//a corresponding positive or negative scalar
-float BSP_tree::f(Vector3 p){
-  Vector3 n = triangle.normal();
-  return dot(n, p-triangle.vertices[0]);
+unsigned int BSP_tree::add_vertex(const Vector3& p){
+  vertices.push_back(p);
+  return vertices.size()-1;
 }
 
-float f(Vector3 p, TreeTriangle triangle){
-  Vector3 n = triangle.normal();
-  return dot(n, p-triangle.vertices[0]);
+unsigned int BSP_tree::create_node(const Triangle& t, unsigned int parent){
+  Plane plane(vertices[t.vertices[0]], vertices[t.vertices[1]],
+	      vertices[t.vertices[2]]);
+  nodes.push_back(BSP_node(t, plane, parent));
+  Bounds& bounds = nodes.back().bounds;
+  for(int j = 0; j < 3; j++){
+    bounds.include(vertices[t.vertices[j]]);
+  }
+  return nodes.size()-1;
 }
 
-template<class T>
-void swap(T& a, T& b){
-  T c = b;
-  b = a;
-  a = c;
+//recomputes the box of every node from the triangles below it, for
+//trees whose nodes were rewired after they were made
+void BSP_tree::bound(){
+  if(isempty())
+    return;
+  //parents come before their children in preorder, so walking it
+  //backwards finishes the children first
+  std::vector<unsigned int> order, stack;
+  order.reserve(nodes.size());
+  stack.push_back(0);
+  while(!stack.empty()){
+    unsigned int cur = stack.back();
+    stack.pop_back();
+    order.push_back(cur);
+    if(is_node(nodes[cur].front)) stack.push_back(nodes[cur].front);
+    if(is_node(nodes[cur].back)) stack.push_back(nodes[cur].back);
+  }
+  for(size_t i = order.size(); i-- > 0;){
+    BSP_node& node = nodes[order[i]];
+    node.bounds = Bounds();
+    for(int j = 0; j < 3; j++){
+      node.bounds.include(vertices[node.triangle.vertices[j]]);
+    }
+    if(is_node(node.front)) node.bounds.include(nodes[node.front].bounds);
+    if(is_node(node.back)) node.bounds.include(nodes[node.back].bounds);
+  }
 }
 
-Vector3 intersect(const Vector3 n, const Vector3 p0, const Vector3 a, const Vector3 c){
-  float num = dot(n,a);
-  Vector3 cma = c-a;
-  float denom = dot(n,cma);
-  float D = - dot(n,p0);
-  float t = -(num+D)/denom;
+//moves the tree by the affine part of transform without rebuilding
+//it: a plane holding a triangle still holds it once both are moved, so
+//every node splits space the way it did. the vertices go through the
+//3x4 matrix in one pass and each normal through the inverse transpose,
+//its offset taken from a corner of the node's triangle. a transform
+//turning space inside out also turns the triangles round, keeping them
+//facing out. EPSILON stays as it is, so after a scale points have to
+//be as near a plane as before to count as on it
+void BSP_tree::apply_transform(const _462::Matrix4& transform){
+  float m[3][4];
+  for(int r = 0; r < 3; r++){
+    for(int c = 0; c < 4; c++){
+      m[r][c] = transform(c, r);
+    }
+  }
+  for(size_t i = 0; i < vertices.size(); i++){
+    Vector3 p = vertices[i];
+    vertices[i] = Vector3(m[0][0]*p.x + m[0][1]*p.y + m[0][2]*p.z + m[0][3],
+			  m[1][0]*p.x + m[1][1]*p.y + m[1][2]*p.z + m[1][3],
+			  m[2][0]*p.x + m[2][1]*p.y + m[2][2]*p.z + m[2][3]);
+  }
+  _462::Matrix3 normals;
+  _462::make_normal_matrix(&normals, transform);
+  float det = m[0][0]*(m[1][1]*m[2][2] - m[1][2]*m[2][1]) -
+    m[0][1]*(m[1][0]*m[2][2] - m[1][2]*m[2][0]) +
+    m[0][2]*(m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+  for(size_t i = 0; i < nodes.size(); i++){
+    BSP_node& node = nodes[i];
+    //the zero plane of a degenerate triangle stays zero, as Plane makes
+    //it, rather than going to NaN
+    Vector3 normal = normals * node.plane.normal;
+    float len = length(normal);
+    node.plane.normal = len > 0.0 ? normal/len : Vector3::Zero();
+    node.plane.d = -dot(node.plane.normal, vertices[node.triangle.vertices[0]]);
+    if(det < 0)
+      std::swap(node.triangle.vertices[1], node.triangle.vertices[2]);
+  }
+  bound();
+}
+
+TreeTriangle BSP_tree::triangle(unsigned int node) const{
+  const Triangle& t = nodes[node].triangle;
+  return TreeTriangle(vertices[t.vertices[0]], vertices[t.vertices[1]],
+		      vertices[t.vertices[2]]);
+}
+
+//point where the edge a->c crosses the plane, given the plane function
+//values at both ends
+Vector3 intersect(const Vector3& a, const Vector3& c, float fa, float fc){
+  float t = fa/(fa-fc);
   return a + t * (c-a);
 }
 
+//the vertices a pass through a tree reads and adds split points to: a
+//pool shared with other passes, which it leaves as it is, followed by
+//the points it makes itself, so passes running side by side don't each
+//need a copy of the pool
+class SplitPool{
+public:
+  SplitPool(const std::vector<Vector3>& pool):pool(pool), base(pool.size()){}
+  inline const Vector3& operator[](size_t i) const {
+    return i < base ? pool[i] : points[i-base];
+  }
+  inline size_t size() const {return base + points.size();}
+  inline void push_back(const Vector3& p){points.push_back(p);}
+  //the split points, the first having index pool.size()
+  std::vector<Vector3> points;
+private:
+  const std::vector<Vector3>& pool;
+  size_t base;
+};
+
+//evaluates the plane function at the three vertices of t, snapping
+//values within EPSILON of the plane to zero
+template<class Pool>
+static inline void classify(const Plane& plane, const Pool& vertices,
+			    const Triangle& t, float& fa, float& fb, float& fc)
+{
+  fa = plane.f(vertices[t.vertices[0]]);
+  fb = plane.f(vertices[t.vertices[1]]);
+  fc = plane.f(vertices[t.vertices[2]]);
+  if(fabs(fa) < EPSILON)
+    fa = 0.0;
+  if(fabs(fb) < EPSILON)
+    fb = 0.0;
+  if(fabs(fc) < EPSILON)
+    fc = 0.0;
+}
+
+//whether the triangle t, lying on plane, faces the same way as it
+template<class Pool>
+static inline bool facing(const Plane& plane, const Pool& vertices, const Triangle& t)
+{
+  const Vector3& a = vertices[t.vertices[0]];
+  return dot(plane.normal, cross(vertices[t.vertices[1]] - a, vertices[t.vertices[2]] - a)) > 0;
+}
+
+//which side of a plane a triangle lies on, from the snapped plane
+//function values of its vertices
+static inline int side(float fa, float fb, float fc){
+  int s = 0;
+  if(fa > 0 || fb > 0 || fc > 0)
+    s |= FRONT;
+  if(fa < 0 || fb < 0 || fc < 0)
+    s |= BACK;
+  return s;
+}
+
+SplitKey::SplitKey(unsigned int u, unsigned int v, unsigned int plane):
+  a(std::min(u,v)), b(std::max(u,v)), plane(plane){}
+
+bool SplitKey::operator<(const SplitKey& rhs) const{
+  if(plane == rhs.plane){
+    if(a == rhs.a){
+      return b < rhs.b;
+    } else {
+      return a < rhs.a;
+    }
+  } else {
+    return plane < rhs.plane;
+  }
+}
+
+//looks key up in cache, adding it with value index if it is not there
+//yet. returns true if it was added
+static inline bool find_or_add(SplitCache& cache, const SplitKey& key, unsigned int& index){
+  std::pair<SplitCache::iterator, bool> rv = cache.insert(std::make_pair(key, index));
+  index = rv.first->second;
+  return rv.second;
+}
+
+//split points of a single pass through a tree, in an open addressing
+//hash table. pushing a model through a tree cuts hundreds of thousands
+//of edges that are looked up once or twice each and thrown away, so this
+//saves the allocation and pointer chasing of a map node per edge
+class EdgeCache{
+public:
+  EdgeCache():count(0){
+    slots.resize(1024);
+  }
+  bool find_or_add(const SplitKey& key, unsigned int& index){
+    if(2*(count+1) > slots.size())
+      grow();
+    size_t mask = slots.size()-1;
+    for(size_t i = hash(key) & mask; ; i = (i+1) & mask){
+      Slot& slot = slots[i];
+      if(slot.value == BSP_NULL){
+	slot.key = key;
+	slot.value = index;
+	count++;
+	return true;
+      }
+      if(slot.key.a == key.a && slot.key.b == key.b && slot.key.plane == key.plane){
+	index = slot.value;
+	return false;
+      }
+    }
+  }
+private:
+  struct Slot{
+    SplitKey key;
+    unsigned int value;
+    Slot():key(0, 0, 0), value(BSP_NULL){}
+  };
+  std::vector<Slot> slots;
+  size_t count;
+  static inline size_t hash(const SplitKey& key){
+    return (key.a*0x9E3779B1u) ^ (key.b*0x85EBCA77u) ^ (key.plane*0xC2B2AE3Du);
+  }
+  void grow(){
+    std::vector<Slot> old(2*slots.size());
+    old.swap(slots);
+    size_t mask = slots.size()-1;
+    for(size_t j = 0; j < old.size(); j++){
+      if(old[j].value == BSP_NULL)
+	continue;
+      size_t i = hash(old[j].key) & mask;
+      while(slots[i].value != BSP_NULL)
+	i = (i+1) & mask;
+      slots[i] = old[j];
+    }
+  }
+};
+
+static inline bool find_or_add(EdgeCache& cache, const SplitKey& key, unsigned int& index){
+  return cache.find_or_add(key, index);
+}
+
+//returns the pool index of the point where the edge a->c crosses the
+//plane of node plane, creating it the first time the edge is cut
+template<class Pool, class Cache>
+static unsigned int split_vertex(unsigned int a, unsigned int c, float fa, float fc,
+				 unsigned int plane, Pool& vertices, Cache& cache)
+{
+  //always interpolate from the lower index so both triangles sharing
+  //the edge would compute the same point
+  if(c < a){
+    std::swap(a,c);
+    std::swap(fa,fc);
+  }
+  unsigned int index = vertices.size();
+  if(find_or_add(cache, SplitKey(a, c, plane), index)){
+    vertices.push_back(intersect(vertices[a], vertices[c], fa, fc));
+  }
+  return index;
+}
+
+//cuts a triangle that straddles the plane of node plane into pieces
+//that each lie on one side of it, and pushes them onto the front and
+//back lists
+template<class Pool, class Cache>
+static void split(Triangle t, float fa, float fb, float fc, unsigned int plane,
+		  Pool& vertices, Cache& cache,
+		  std::vector<Triangle>& front, std::vector<Triangle>& back)
+{
+  unsigned int &a = t.vertices[0];
+  unsigned int &b = t.vertices[1];
+  unsigned int &c = t.vertices[2];
+  //rotate the vertices so c is alone on its side of the plane
+  if(fa*fc>=0){
+    std::swap(fb, fc);
+    std::swap(b,c);
+    std::swap(fa, fb);
+    std::swap(a,b);
+  }
+  else if(fb*fc>=0){
+    std::swap(fa,fc);
+    std::swap(a,c);
+    std::swap(fa,fb);
+    std::swap(a,b);
+  }
+  unsigned int A = a;
+  unsigned int B = b;
+  if(fa != 0.0)
+    A = split_vertex(a, c, fa, fc, plane, vertices, cache);
+  if(fb != 0.0)
+    B = split_vertex(b, c, fb, fc, plane, vertices, cache);
+  std::vector<Triangle>& ab_side = fc > 0 ? back : front;
+  std::vector<Triangle>& c_side = fc > 0 ? front : back;
+  Triangle T;
+  //a vertex lying on the plane only needs a cut through it, so skip
+  //the piece that would collapse to a line
+  if(fa != 0.0){
+    T.vertices[0] = a; T.vertices[1] = b; T.vertices[2] = A;
+    ab_side.push_back(T);
+  }
+  if(fb != 0.0){
+    T.vertices[0] = b; T.vertices[1] = B; T.vertices[2] = A;
+    ab_side.push_back(T);
+  }
+  T.vertices[0] = A; T.vertices[1] = B; T.vertices[2] = c;
+  c_side.push_back(T);
+}
+
+//sorts one triangle by the plane of node plane, see partition
+static inline void partition(const Plane& p, unsigned int plane, const Triangle& t,
+			     std::vector<Vector3>& vertices, SplitCache& cache,
+			     std::vector<Triangle>& front, std::vector<Triangle>& back,
+			     std::vector<Triangle>& coplanar)
+{
+  float fa, fb, fc;
+  classify(p, vertices, t, fa, fb, fc);
+  switch(side(fa, fb, fc)){
+  case COPLANAR: coplanar.push_back(t); break;
+  case FRONT: front.push_back(t); break;
+  case BACK: back.push_back(t); break;
+  default: split(t, fa, fb, fc, plane, vertices, cache, front, back); break;
+  }
+}
+
+//lists shorter than this are not worth gathering into a block
+#define MIN_BLOCK 64
+
+//sorts the triangles of list by the plane of node plane, splitting
+//the ones that span it. coplanar triangles go to the coplanar list,
+//which may be the same as front or back. long lists are classified a
+//block at a time with the vector kernel
+static void partition(const Plane& p, unsigned int plane, const std::vector<Triangle>& list,
+		      std::vector<Vector3>& vertices, SplitCache& cache,
+		      std::vector<Triangle>& front, std::vector<Triangle>& back,
+		      std::vector<Triangle>& coplanar)
+{
+  if(list.size() < MIN_BLOCK){
+    for(size_t i = 0; i < list.size(); i++){
+      partition(p, plane, list[i], vertices, cache, front, back, coplanar);
+    }
+    return;
+  }
+  TriangleBlock block;
+  unsigned char sides[BLOCK_SIZE];
+  for(size_t start = 0; start < list.size(); start += BLOCK_SIZE){
+    size_t n = std::min((size_t)BLOCK_SIZE, list.size() - start);
+    for(size_t i = 0; i < n; i++){
+      const Triangle& t = list[start+i];
+      for(int k = 0; k < 3; k++){
+	const Vector3& v = vertices[t.vertices[k]];
+	block.x[k][i] = v.x;
+	block.y[k][i] = v.y;
+	block.z[k][i] = v.z;
+      }
+    }
+    classify_triangles(p, EPSILON, block, n, sides);
+    for(size_t i = 0; i < n; i++){
+      const Triangle& t = list[start+i];
+      switch(sides[i]){
+      case COPLANAR: coplanar.push_back(t); break;
+      case FRONT: front.push_back(t); break;
+      case BACK: back.push_back(t); break;
+      default:
+	//the split needs the plane function values, and this settles
+	//triangles sitting right at the snapping distance the same way
+	//classify does everywhere else
+	partition(p, plane, t, vertices, cache, front, back, coplanar);
+	break;
+      }
+    }
+  }
+}
+
+//copies triangles into a vertex pool, three new vertices each
+static void pool(const std::vector<TreeTriangle>& list, std::vector<Vector3>& vertices,
+		 std::vector<Triangle>& triangles)
+{
+  vertices.reserve(vertices.size() + 3*list.size());
+  triangles.reserve(triangles.size() + list.size());
+  Triangle t;
+  for(size_t i = 0; i < list.size(); i++){
+    for(int j = 0; j < 3; j++){
+      t.vertices[j] = vertices.size();
+      vertices.push_back(list[i].vertices[j]);
+    }
+    triangles.push_back(t);
+  }
+}
+
+//the inverse of pool, appends the triangles by value to list
+static void expand(const std::vector<Vector3>& vertices, const std::vector<Triangle>& triangles,
+		   std::vector<TreeTriangle>& list)
+{
+  list.reserve(list.size() + triangles.size());
+  for(size_t i = 0; i < triangles.size(); i++){
+    const Triangle& t = triangles[i];
+    list.push_back(TreeTriangle(vertices[t.vertices[0]], vertices[t.vertices[1]],
+				vertices[t.vertices[2]]));
+  }
+}
+
 BSP_tree* create_tree(std::vector<TreeTriangle> triangles){
-  BSP_tree *tree = new BSP_tree(triangles.back());
-  triangles.pop_back();
+  BSP_tree *tree = new BSP_tree();
   tree->add(triangles);
   return tree;
 }
 
-//implement here
-void BSP_tree::add(TreeTriangle to_add){
+//builds the tree straight from the indexed mesh, so vertices shared
+//between triangles are stored once
+BSP_tree* create_tree(const Mesh& mesh){
+  BSP_tree *tree = new BSP_tree();
+  //every split adds two triangles, so leave room for a fair number
+  //of them before the pools have to grow
+  tree->vertices.reserve(mesh.vertices.size() + 2*mesh.triangles.size());
+  for(size_t i = 0; i < mesh.vertices.size(); i++){
+    tree->vertices.push_back(mesh.vertices[i].position);
+  }
+  std::vector<Triangle> triangles(mesh.triangles);
+  tree->reserve(2*triangles.size());
+  tree->add_indexed(triangles);
+  return tree;
+}
+
+BuildOptions::BuildOptions():candidates(8), sample_size(64),
+			     split_weight(8.0), balance_weight(1.0),
+			     threads(0), grain_size(4096){}
 
+//builds the tree top-down from the indexed mesh, choosing each
+//splitting plane with the cost model in options
+BSP_tree* create_tree(const Mesh& mesh, const BuildOptions& options){
+  BSP_tree *tree = new BSP_tree();
+  tree->vertices.reserve(mesh.vertices.size() + 2*mesh.triangles.size());
+  for(size_t i = 0; i < mesh.vertices.size(); i++){
+    tree->vertices.push_back(mesh.vertices[i].position);
+  }
+  std::vector<Triangle> triangles(mesh.triangles);
+  tree->reserve(2*triangles.size());
+  tree->build(triangles, options);
+  return tree;
 }
-void BSP_tree::add(std::vector<TreeTriangle> to_add)
+
+//picks the splitting triangle for list among evenly spaced candidates,
+//estimating each one's cost from an evenly spaced sample of list. the
+//sample is gathered a block at a time and every candidate plane is
+//run over the block with the vector kernel
+static size_t choose_splitter(const std::vector<Vector3>& vertices,
+			      const std::vector<Triangle>& list,
+			      const BuildOptions& options)
 {
-  TreeTriangle t;
-  while(!to_add.empty()){
-    BSP_tree * ancestor = NULL;
-    BSP_tree* root = this;
-    t = to_add.back();
-    to_add.pop_back();
-    while(root!=NULL){
-      Vector3 &a = t.vertices[0];
-      Vector3 &b = t.vertices[1];
-      Vector3 &c = t.vertices[2];
-      float fa = f(a);
-      float fb = f(b);
-      float fc = f(c);
-      if(fabs(fa) < EPSILON)
-	fa = 0.0;
-      if(fabs(fb) < EPSILON)
-	fb = 0.0;
-      if(fabs(fc) < EPSILON)
-	fc = 0.0;
-  
-      //all points are on the front side of the plane
-      if(fa<0  && fb<0 && fc<0){
-	if(root->back == NULL){
-	  root->back = new BSP_tree(t);
-	  root->back->parent = root;
-	  break;
-	}
-	ancestor = root;
-	root = root->back;
-	continue;
+  size_t n = list.size();
+  if(options.candidates <= 1 || n <= 2)
+    return n-1;
+  size_t k_max = std::min((size_t)options.candidates, n);
+  size_t s_max = options.sample_size == 0 ? n : std::min((size_t)options.sample_size, n);
+  std::vector<Plane> planes(k_max);
+  std::vector<int> count(4*k_max, 0);
+  for(size_t k = 0; k < k_max; k++){
+    const Triangle& c = list[n-1 - (k*n)/k_max];
+    planes[k] = Plane(vertices[c.vertices[0]], vertices[c.vertices[1]], vertices[c.vertices[2]]);
+  }
+  TriangleBlock block;
+  unsigned char sides[BLOCK_SIZE];
+  for(size_t start = 0; start < s_max; start += BLOCK_SIZE){
+    size_t m = std::min((size_t)BLOCK_SIZE, s_max - start);
+    for(size_t s = 0; s < m; s++){
+      const Triangle& t = list[((start+s)*n)/s_max];
+      for(int j = 0; j < 3; j++){
+	const Vector3& v = vertices[t.vertices[j]];
+	block.x[j][s] = v.x;
+	block.y[j][s] = v.y;
+	block.z[j][s] = v.z;
       }
-      //all points are on the back side of the plane
-      else if(fa>0  && fb>0 && fc>0){
-	if(root->front == NULL){
-	  root->front = new BSP_tree(t);
-	  root->front->parent = root;
-	  break;
-	}
-	ancestor = root;
-	root = root->front;
-	continue;
+    }
+    for(size_t k = 0; k < k_max; k++){
+      classify_triangles(planes[k], EPSILON, block, m, sides);
+      for(size_t s = 0; s < m; s++){
+	count[4*k + sides[s]]++;
       }
-      else if(fa==0  && fb==0 && fc==0){
-	while(root != NULL){
-	  root = root->front
-	}
-	if(root->front == NULL){
-	  root->front = new BSP_tree(t);
-	  root->front->parent = root;
-	}
-	ancestor = root;
-	root = root->front;
-	continue;
+    }
+  }
+  size_t best = n-1;
+  float best_cost = -1.0;
+  for(size_t k = 0; k < k_max; k++){
+    //a degenerate triangle does not split anything
+    if(planes[k].normal == Vector3::Zero())
+      continue;
+    //coplanar triangles end up in the front subtree
+    int front = count[4*k + FRONT] + count[4*k + COPLANAR];
+    float cost = options.split_weight * count[4*k + SPANNING] +
+      options.balance_weight * abs(front - count[4*k + BACK]);
+    if(best_cost < 0 || cost < best_cost){
+      best_cost = cost;
+      best = n-1 - (k*n)/k_max;
+    }
+  }
+  return best;
+}
+
+//a list of triangles still to be built into the subtree hanging off
+//parent on the given side
+struct PendingSubtree{
+  unsigned int parent;
+  bool front;
+  std::vector<Triangle> triangles;
+};
+
+//a subtree big enough to be built by another thread. it is built as
+//a tree of its own over the vertices its triangles use, then grafted
+//back under parent
+struct Fork{
+  unsigned int parent;
+  bool front;
+  std::vector<Triangle> triangles;
+  BSP_tree tree;
+  //index in the forking tree of each vertex copied into tree
+  std::vector<unsigned int> map;
+};
+
+//moves the triangles of fork into its own tree, copying over just the
+//vertices they use
+static void gather(const BSP_tree& tree, Fork& fork)
+{
+  std::vector<unsigned int>& map = fork.map;
+  map.reserve(3*fork.triangles.size());
+  for(size_t i = 0; i < fork.triangles.size(); i++){
+    for(int j = 0; j < 3; j++){
+      map.push_back(fork.triangles[i].vertices[j]);
+    }
+  }
+  std::sort(map.begin(), map.end());
+  map.erase(std::unique(map.begin(), map.end()), map.end());
+  fork.tree.vertices.reserve(2*map.size());
+  for(size_t i = 0; i < map.size(); i++){
+    fork.tree.vertices.push_back(tree.vertices[map[i]]);
+  }
+  for(size_t i = 0; i < fork.triangles.size(); i++){
+    for(int j = 0; j < 3; j++){
+      unsigned int &v = fork.triangles[i].vertices[j];
+      v = std::lower_bound(map.begin(), map.end(), v) - map.begin();
+    }
+  }
+  fork.tree.reserve(2*fork.triangles.size());
+}
+
+//appends the nodes built by fork to tree under its parent, moving its
+//vertex indices back into the pool of tree
+static void graft(BSP_tree& tree, const Fork& fork)
+{
+  const BSP_tree& sub = fork.tree;
+  if(sub.isempty())
+    return;
+  const std::vector<unsigned int>& map = fork.map;
+  size_t gathered = map.size();
+  unsigned int vertex_base = tree.vertices.size() - gathered;
+  unsigned int node_base = tree.nodes.size();
+  tree.vertices.insert(tree.vertices.end(), sub.vertices.begin()+gathered, sub.vertices.end());
+  for(size_t i = 0; i < sub.nodes.size(); i++){
+    BSP_node node = sub.nodes[i];
+    for(int j = 0; j < 3; j++){
+      unsigned int &v = node.triangle.vertices[j];
+      v = v < gathered ? map[v] : vertex_base + v;
+    }
+    if(is_node(node.front)) node.front += node_base;
+    if(is_node(node.back)) node.back += node_base;
+    node.parent = node.parent == BSP_NULL ? fork.parent : node.parent + node_base;
+    tree.nodes.push_back(node);
+  }
+  if(fork.front)
+    tree.nodes[fork.parent].front = node_base;
+  else
+    tree.nodes[fork.parent].back = node_base;
+  for(SplitCache::const_iterator it = sub.split_cache.begin(); it != sub.split_cache.end(); ++it){
+    unsigned int a = it->first.a < gathered ? map[it->first.a] : vertex_base + it->first.a;
+    unsigned int b = it->first.b < gathered ? map[it->first.b] : vertex_base + it->first.b;
+    tree.split_cache.insert(std::make_pair(SplitKey(a, b, it->first.plane + node_base),
+					   vertex_base + it->second));
+  }
+}
+
+//builds the triangles top-down: each node picks its splitter from the
+//triangles that reach it, then partitions the rest. once a node leaves
+//more than options.grain_size triangles on both sides, each side is
+//spawned as a task so idle threads can pick it up
+static void build_task(BSP_tree& tree, std::vector<Triangle>& list, const BuildOptions& options)
+{
+  std::vector<PendingSubtree> stack(1);
+  stack.back().parent = BSP_NULL;
+  stack.back().front = false;
+  stack.back().triangles.swap(list);
+  std::vector<Fork*> forks;
+  std::vector<Triangle> triangles;
+  while(!stack.empty()){
+    unsigned int parent = stack.back().parent;
+    bool front = stack.back().front;
+    triangles.clear();
+    triangles.swap(stack.back().triangles);
+    stack.pop_back();
+    if(triangles.empty())
+      continue;
+
+    size_t s = choose_splitter(tree.vertices, triangles, options);
+    Triangle splitter = triangles[s];
+    triangles[s] = triangles.back();
+    triangles.pop_back();
+    unsigned int node = tree.create_node(splitter, parent);
+    if(parent != BSP_NULL){
+      if(front)
+	tree.nodes[parent].front = node;
+      else
+	tree.nodes[parent].back = node;
+    }
+
+    stack.resize(stack.size()+2);
+    PendingSubtree& back_side = stack[stack.size()-2];
+    PendingSubtree& front_side = stack[stack.size()-1];
+    back_side.parent = front_side.parent = node;
+    back_side.front = false;
+    front_side.front = true;
+    //coplanar triangles are kept in the front subtree
+    partition(tree.nodes[node].plane, node, triangles, tree.vertices, tree.split_cache,
+	      front_side.triangles, back_side.triangles, front_side.triangles);
+
+    if(options.grain_size > 0 &&
+       front_side.triangles.size() > options.grain_size &&
+       back_side.triangles.size() > options.grain_size){
+      for(int k = 0; k < 2; k++){
+	PendingSubtree& pending = stack.back();
+	Fork* fork = new Fork();
+	fork->parent = pending.parent;
+	fork->front = pending.front;
+	fork->triangles.swap(pending.triangles);
+	stack.pop_back();
+	gather(tree, *fork);
+	forks.push_back(fork);
+#pragma omp task firstprivate(fork) shared(options)
+	build_task(fork->tree, fork->triangles, options);
       }
+    }
+  }
+#pragma omp taskwait
+  for(size_t i = 0; i < forks.size(); i++){
+    graft(tree, *forks[i]);
+    delete forks[i];
+  }
+}
+
+//builds the triangles top-down into an empty tree, on options.threads
+//threads. list is used as the work list and is left empty
+void BSP_tree::build(std::vector<Triangle>& list, const BuildOptions& options)
+{
+#ifdef OPENMP
+  int threads = options.threads > 0 ? options.threads : omp_get_max_threads();
+#else
+  int threads = 1;
+#endif
+  if(threads <= 1 || list.size() <= options.grain_size){
+    BuildOptions serial = options;
+    serial.grain_size = 0;
+    build_task(*this, list, serial);
+  } else {
+#pragma omp parallel num_threads(threads)
+    {
+#pragma omp single
+      build_task(*this, list, options);
+    }
+  }
+  bound();
+}
+
+unsigned int depth(const BSP_tree* tree){
+  if(tree->isempty())
+    return 0;
+  std::vector<unsigned int> stack, level;
+  stack.push_back(0);
+  level.push_back(1);
+  unsigned int max_depth = 0;
+  while(!stack.empty()){
+    unsigned int cur = stack.back();
+    unsigned int d = level.back();
+    stack.pop_back();
+    level.pop_back();
+    max_depth = std::max(max_depth, d);
+    const BSP_node& node = tree->nodes[cur];
+    if(is_node(node.front)){
+      stack.push_back(node.front);
+      level.push_back(d+1);
+    }
+    if(is_node(node.back)){
+      stack.push_back(node.back);
+      level.push_back(d+1);
+    }
+  }
+  return max_depth;
+}
+
+//copies the triangle into the vertex pool before adding it
+void BSP_tree::add(TreeTriangle to_add){
+  Triangle t;
+  for(int j = 0; j < 3; j++){
+    t.vertices[j] = add_vertex(to_add.vertices[j]);
+  }
+  add_indexed(t);
+}
+
+//copies the triangles into the vertex pool before adding them
+void BSP_tree::add(std::vector<TreeTriangle> to_add)
+{
+  std::vector<Triangle> triangles;
+  vertices.reserve(vertices.size() + 5*to_add.size());
+  reserve(nodes.size() + 2*to_add.size());
+  pool(to_add, vertices, triangles);
+  add_indexed(triangles);
+}
+
+//adds a triangle indexing the vertex pool. it is walked down from the
+//root and becomes a leaf, pieces of a split carrying on from the node
+//that cut them
+void BSP_tree::add_indexed(const Triangle& to_add)
+{
+  float fa, fb, fc;
+  if(isempty()){
+    create_node(to_add, BSP_NULL);
+    return;
+  }
+  pending.push_back(PendingTriangle(0, to_add));
+  while(!pending.empty()){
+    unsigned int root = pending.back().first;
+    Triangle t = pending.back().second;
+    pending.pop_back();
+    while(root != BSP_NULL){
+      classify(nodes[root].plane, vertices, t, fa, fb, fc);
+      int s = side(fa, fb, fc);
       //we have to split the triangle
-      else{
-	//std::cout<<"Split"<<std::endl;
-	if(fa*fc>=0){
-	  swap(fb, fc);
-	  swap(b,c);
-	  swap(fa, fb);
-	  swap(a,b);
+      if(s == SPANNING){
+	pieces.clear();
+	split(t, fa, fb, fc, root, vertices, split_cache, pieces, pieces);
+	for(size_t j = 0; j < pieces.size(); j++){
+	  pending.push_back(PendingTriangle(root, pieces[j]));
 	}
-	else if(fb*fc>=0){
-	  swap(fa,fc);
-	  swap(a,c);
-	  swap(fa,fb);
-	  swap(a,b);
+	break;
+      }
+      //coplanar triangles are kept in the front subtree
+      unsigned int child = s == BACK ? nodes[root].back : nodes[root].front;
+      if(!is_node(child)){
+	//create_node may move the pool, so the parent is looked up again
+	child = create_node(t, root);
+	if(s == BACK)
+	  nodes[root].back = child;
+	else
+	  nodes[root].front = child;
+	for(unsigned int n = root; n != BSP_NULL; n = nodes[n].parent){
+	  nodes[n].bounds.include(nodes[child].bounds);
 	}
-	Vector3 A =intersect(triangle.normal(), triangle.vertices[0], a, c);
-	Vector3 B =intersect(triangle.normal(), triangle.vertices[0], b, c);
-	TreeTriangle T1(a,b,A);
-	TreeTriangle T2(b,B,A);
-	TreeTriangle T3(A,B,c);
-	to_add.push_back(T1);
-	to_add.push_back(T2);
-	to_add.push_back(T3);
 	break;
       }
-    } 
-    //    std::cout<<to_add.size()<<std::endl;
+      root = child;
+    }
+  }
+}
+
+//adds triangles indexing the vertex pool; to_add is used as the work
+//list and is left empty
+void BSP_tree::add_indexed(std::vector<Triangle>& to_add)
+{
+  while(!to_add.empty()){
+    Triangle t = to_add.back();
+    to_add.pop_back();
+    add_indexed(t);
   }
 }
 
 
-void traverse(BSP_tree* node, std::vector<TreeTriangle> &list)
+void traverse(const BSP_tree* tree, std::vector<Triangle> &list)
 {
-  std::vector<BSP_tree*> stack;
-  stack.push_back(node);
-  BSP_tree * cur;
+  if(tree->isempty())
+    return;
+  list.reserve(list.size() + tree->size());
+  std::vector<unsigned int> stack;
+  stack.push_back(0);
+  unsigned int cur;
   while(!stack.empty()){
     cur = stack.back();
     stack.pop_back();
-    list.push_back(cur->triangle);
-    if(cur->front != NULL) stack.push_back(cur->front);
-    if(cur->back != NULL) stack.push_back(cur->back);
+    const BSP_node& node = tree->nodes[cur];
+    if(!node.hidden)
+      list.push_back(node.triangle);
+    if(is_node(node.front)) stack.push_back(node.front);
+    if(is_node(node.back)) stack.push_back(node.back);
   }
 }
 
-void traverse(BSP_tree* node)
+void traverse(const BSP_tree* tree, std::vector<TreeTriangle> &list)
+{
+  std::vector<Triangle> triangles;
+  traverse(tree, triangles);
+  expand(tree->vertices, triangles, list);
+}
+
+void traverse(const BSP_tree* tree)
 {
-  std::vector<BSP_tree*> stack;
-  stack.push_back(node);
-  BSP_tree * cur;
+  if(tree->isempty())
+    return;
+  std::vector<unsigned int> stack;
+  stack.push_back(0);
+  unsigned int cur;
   while(!stack.empty()){
     cur = stack.back();
     stack.pop_back();
-    std::cout<<"("<<cur->triangle.vertices[0][0]<<", "<<
-      cur->triangle.vertices[0][1]<<", "<<cur->triangle.vertices[0][2]<<")"<<std::endl;
-    if(cur->front != NULL) stack.push_back(cur->front);
-    if(cur->back != NULL) stack.push_back(cur->back);
+    const BSP_node& node = tree->nodes[cur];
+    const Vector3& v = tree->vertices[node.triangle.vertices[0]];
+    std::cout<<"("<<v[0]<<", "<<v[1]<<", "<<v[2]<<")"<<std::endl;
+    if(is_node(node.front)) stack.push_back(node.front);
+    if(is_node(node.back)) stack.push_back(node.back);
   }
 }
 
-void insert(BSP_tree * tree, std::vector<TreeTriangle> list,
-	    std::vector<TreeTriangle> &inside, std::vector<TreeTriangle> &outside)
+//walks p down from node root, returning the node whose leaf it ends up
+//in and setting back to the side of it. a point on a plane counts as
+//behind it the way triangles do in insert
+static unsigned int locate(const BSP_tree* tree, unsigned int root, const Vector3& p, bool& back)
 {
-  std::vector<TreeTriangle> to_add = list;
-  TreeTriangle t;
-  while(!to_add.empty()){
-    BSP_tree* root = tree;
-    t = to_add.back();
-    to_add.pop_back();
-    while(root!=NULL){
-      Vector3 &a = t.vertices[0];
-      Vector3 &b = t.vertices[1];
-      Vector3 &c = t.vertices[2];
-      float fa = f(a, root->triangle);
-      float fb = f(b, root->triangle);
-      float fc = f(c, root->triangle);
-      if(fabs(fa) < EPSILON || fa!=fa)
-	fa = 0.0;
-      if(fabs(fb) < EPSILON || fb!=fb)
-	fb = 0.0;
-      if(fabs(fc) < EPSILON || fc!=fc)
-	fc = 0.0;
-      assert(fa==fa);
-      assert(fb==fb);
-      assert(fc==fc);
-      
-  
-      //all points are on the front side of the plane
-      if(fa<=0  && fb<=0 && fc<=0){
-	if(root->back == NULL){
-	  inside.push_back(t);
-	  break;
+  while(true){
+    const BSP_node& node = tree->nodes[root];
+    back = node.f(p) < EPSILON;
+    unsigned int child = back ? node.back : node.front;
+    if(!is_node(child))
+      return root;
+    root = child;
+  }
+}
+
+//which side of a plane of the tree a triangle lying on it goes to, by
+//whether it faces the same way. insert sends every one behind it. the
+//surface of one operand of op pushed through the tree of the other has
+//to put a face the two share on the result once though: facing the
+//same way it goes behind for the first operand and in front for the
+//second, so whatever op keeps comes from one of them, and facing the
+//other way, where the solids only touch, it goes behind for a union and
+//in front otherwise, so it stays only on the first operand of a
+//difference
+struct Coplanar{
+  bool same_behind;
+  bool opposite_behind;
+  Coplanar():same_behind(true), opposite_behind(true){}
+  Coplanar(csg_type op, bool first):same_behind(first), opposite_behind(op == CSG_UNION){}
+  inline bool behind(bool same) const {return same ? same_behind : opposite_behind;}
+};
+
+//locate for the centroid of t, which keeps clear of the triangles
+//below root. where the centroid lies on a plane it goes the way
+//coplanar sends t, as t may lie on the plane too: a plane repeated
+//further down, on the side t was sent to at the first, has nothing on
+//its other side
+template<class Pool>
+static unsigned int locate(const BSP_tree* tree, unsigned int root, const Pool& vertices,
+			   const Triangle& t, const Coplanar& coplanar, bool& back)
+{
+  Vector3 centroid = (vertices[t.vertices[0]] + vertices[t.vertices[1]] +
+		      vertices[t.vertices[2]]) / 3.0;
+  while(true){
+    const BSP_node& node = tree->nodes[root];
+    float f = node.f(centroid);
+    if(fabs(f) < EPSILON)
+      back = coplanar.behind(facing(node.plane, vertices, t));
+    else
+      back = f < 0;
+    unsigned int child = back ? node.back : node.front;
+    if(!is_node(child))
+      return root;
+    root = child;
+  }
+}
+
+//pushes triangles indexing vertices through the tree down to its
+//leaves, appending split points to vertices. each triangle goes all the
+//way down on its own while its vertices are in cache, and the pieces of
+//a split carry on from the child on their side of the node that cut
+//it, as the cut already tells which side they are on.
+//sink(t, node, back) is called for every piece t ending up in the leaf
+//on the back or front of node, and sink.coplanar tells where a piece
+//lying on a plane goes.
+//if whole is set, a triangle clear of the box of a subtree is not cut
+//up by its planes: the triangles of a subtree are all of the surface in
+//its cell, so nothing in the cell away from them changes sides, and the
+//leaf its centroid falls in stands for the whole triangle
+template<class Pool, class Sink>
+static void descend(const BSP_tree * tree, Pool& vertices,
+		    const std::vector<Triangle>& list, EdgeCache& cache, bool whole, Sink& sink)
+{
+  std::vector<PendingTriangle> stack;
+  std::vector<Triangle> front, back;
+  float fa, fb, fc;
+  stack.reserve(list.size());
+  for(size_t i = 0; i < list.size(); i++){
+    stack.push_back(PendingTriangle(0, list[i]));
+  }
+  while(!stack.empty()){
+    unsigned int root = stack.back().first;
+    Triangle t = stack.back().second;
+    stack.pop_back();
+    Bounds box;
+    for(int j = 0; j < 3; j++){
+      box.include(vertices[t.vertices[j]]);
+    }
+    while(true){
+      const BSP_node& node = tree->nodes[root];
+      if(whole && !node.bounds.overlaps(box, 2*EPSILON)){
+	bool back;
+	unsigned int leaf = locate(tree, root, vertices, t, sink.coplanar, back);
+	sink(t, leaf, back);
+	break;
+      }
+      classify(node.plane, vertices, t, fa, fb, fc);
+      int s = side(fa, fb, fc);
+      //we have to split the triangle
+      if(s == SPANNING){
+	front.clear();
+	back.clear();
+	split(t, fa, fb, fc, root, vertices, cache, front, back);
+	for(size_t j = 0; j < front.size(); j++){
+	  if(is_node(node.front))
+	    stack.push_back(PendingTriangle(node.front, front[j]));
+	  else
+	    sink(front[j], root, false);
 	}
-	root = root->back;
-	continue;
+	for(size_t j = 0; j < back.size(); j++){
+	  if(is_node(node.back))
+	    stack.push_back(PendingTriangle(node.back, back[j]));
+	  else
+	    sink(back[j], root, true);
+	}
+	break;
+      }
+      bool behind = s == BACK;
+      if(s == COPLANAR)
+	behind = sink.coplanar.behind(facing(node.plane, vertices, t));
+      unsigned int child = behind ? node.back : node.front;
+      if(!is_node(child)){
+	sink(t, root, behind);
+	break;
       }
-      //all points are on the back side of the plane
-      else if(fa>=0  && fb>=0 && fc>=0){
-	if(root->front == NULL){
-	  outside.push_back(t);
-	  break;
+      root = child;
+    }
+  }
+}
+
+//sorts the triangles reaching the leaves of tree by whether the leaf is
+//inside the model. either list may be NULL, dropping the triangles on
+//that side as soon as they land
+struct InsideOutside{
+  const BSP_tree* tree;
+  std::vector<Triangle>* inside;
+  std::vector<Triangle>* outside;
+  Coplanar coplanar;
+  InsideOutside(const BSP_tree* tree, std::vector<Triangle>* inside,
+		std::vector<Triangle>* outside, const Coplanar& coplanar):
+    tree(tree), inside(inside), outside(outside), coplanar(coplanar){}
+  void operator()(const Triangle& t, unsigned int node, bool back){
+    const BSP_node& parent = tree->nodes[node];
+    std::vector<Triangle>* list =
+      leaf_inside(back ? parent.back : parent.front, back) ? inside : outside;
+    if(list)
+      list->push_back(t);
+  }
+};
+
+//pushes triangles indexing vertices through the tree, sorting them
+//into the ones that end up inside and outside the model. split points
+//are appended to vertices
+static void insert(const BSP_tree * tree, std::vector<Vector3>& vertices,
+		   const std::vector<Triangle>& list, const Coplanar& coplanar,
+		   std::vector<Triangle> &inside, std::vector<Triangle> &outside)
+{
+  if(tree->isempty()){
+    outside.insert(outside.end(), list.begin(), list.end());
+    return;
+  }
+  EdgeCache cache;
+  InsideOutside sink(tree, &inside, &outside, coplanar);
+  descend(tree, vertices, list, cache, true, sink);
+}
+
+void insert(const BSP_tree * tree, std::vector<Vector3>& vertices,
+	    const std::vector<Triangle>& list, std::vector<Triangle> &inside,
+	    std::vector<Triangle> &outside)
+{
+  insert(tree, vertices, list, Coplanar(), inside, outside);
+}
+
+//insert for the surface of one operand of op, list coming from the
+//first if first is set, so a face the operands share is on the result
+//once
+void insert(const BSP_tree * tree, std::vector<Vector3>& vertices,
+	    const std::vector<Triangle>& list, csg_type op, bool first,
+	    std::vector<Triangle> &inside, std::vector<Triangle> &outside)
+{
+  insert(tree, vertices, list, Coplanar(op, first), inside, outside);
+}
+
+//triangles each thread should have at least before a list is cut up
+#define SHARD_SIZE 256
+
+//a slice of a list of triangles pushed through tree on a thread of its
+//own. it reads the vertex pool every shard shares and keeps the split
+//points it makes to itself, numbered on from the end of the pool
+struct Shard{
+  const BSP_tree* tree;
+  const std::vector<Vector3>* pool;
+  std::vector<Triangle> triangles;
+  bool keep_inside;
+  bool keep_outside;
+  Coplanar coplanar;
+  std::vector<Vector3> points;
+  std::vector<Triangle> inside;
+  std::vector<Triangle> outside;
+};
+
+//cuts list into up to threads shards to be pushed through tree, keeping
+//the fragments on the sides asked for
+static void shard(const BSP_tree* tree, const std::vector<Vector3>& pool,
+		  const std::vector<Triangle>& list, bool keep_inside, bool keep_outside,
+		  int threads, std::vector<Shard>& shards)
+{
+  size_t count = std::max((size_t)1, std::min((size_t)std::max(threads, 1),
+					      list.size()/SHARD_SIZE));
+  for(size_t i = 0; i < count; i++){
+    shards.push_back(Shard());
+    Shard& s = shards.back();
+    s.tree = tree;
+    s.pool = &pool;
+    s.triangles.assign(list.begin() + (i*list.size())/count,
+		       list.begin() + ((i+1)*list.size())/count);
+    s.keep_inside = keep_inside;
+    s.keep_outside = keep_outside;
+  }
+}
+
+//pushes every shard through its tree, on threads threads
+static void run(std::vector<Shard>& shards, int threads)
+{
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+  for(int i = 0; i < (int)shards.size(); i++){
+    Shard& s = shards[i];
+    if(s.tree->isempty()){
+      if(s.keep_outside)
+	s.outside.swap(s.triangles);
+      continue;
+    }
+    SplitPool vertices(*s.pool);
+    EdgeCache cache;
+    InsideOutside sink(s.tree, s.keep_inside ? &s.inside : NULL,
+		       s.keep_outside ? &s.outside : NULL, s.coplanar);
+    descend(s.tree, vertices, s.triangles, cache, true, sink);
+    s.points.swap(vertices.points);
+  }
+}
+
+//appends the split points and fragments of shards [first, last) to
+//vertices, inside and outside. vertices must be the pool the shards
+//read. going in shard order keeps the result the same whatever
+//thread ran which shard
+static void join(std::vector<Shard>& shards, size_t first, size_t last,
+		 std::vector<Vector3>& vertices, std::vector<Triangle>& inside,
+		 std::vector<Triangle>& outside)
+{
+  unsigned int base = vertices.size();
+  for(size_t i = first; i < last; i++){
+    Shard& s = shards[i];
+    unsigned int offset = vertices.size() - base;
+    vertices.insert(vertices.end(), s.points.begin(), s.points.end());
+    for(int side = 0; side < 2; side++){
+      std::vector<Triangle>& from = side ? s.outside : s.inside;
+      std::vector<Triangle>& to = side ? outside : inside;
+      for(size_t j = 0; j < from.size(); j++){
+	Triangle t = from[j];
+	for(int k = 0; k < 3; k++){
+	  if(t.vertices[k] >= base)
+	    t.vertices[k] += offset;
 	}
-	root = root->front;
+	to.push_back(t);
+      }
+    }
+  }
+}
+
+void insert(const BSP_tree * tree, const std::vector<TreeTriangle>& list,
+	    std::vector<TreeTriangle> &inside, std::vector<TreeTriangle> &outside)
+{
+  std::vector<Vector3> vertices;
+  std::vector<Triangle> triangles, in, out;
+  pool(list, vertices, triangles);
+  insert(tree, vertices, triangles, in, out);
+  expand(vertices, in, inside);
+  expand(vertices, out, outside);
+}
+
+
+//whether p is inside the model of tree
+bool point_inside(const BSP_tree* tree, const Vector3& p)
+{
+  if(tree->isempty())
+    return false;
+  bool back;
+  unsigned int node = locate(tree, 0, p, back);
+  const BSP_node& parent = tree->nodes[node];
+  return leaf_inside(back ? parent.back : parent.front, back);
+}
+
+//points classify_points sends down the tree together
+#define PACKET_SIZE 4096
+
+//a run [begin, end) of the points of a packet waiting at node
+struct PointRun{
+  unsigned int node;
+  size_t begin;
+  size_t end;
+  PointRun(unsigned int node, size_t begin, size_t end):node(node), begin(begin), end(end){}
+};
+
+//per thread work space of classify_points, the coordinates of a packet
+//as structure of arrays with the index each point came from
+struct PointPacket{
+  std::vector<float> x, y, z;
+  std::vector<unsigned int> index;
+  std::vector<unsigned char> sides;
+  std::vector<PointRun> stack;
+};
+
+//sets inside[i] for the points [first, last). the run of points at a
+//node is tested against its plane in one pass and split in place into
+//the points in front of it and the rest, each part going on down its
+//child. a point on the plane counts as behind it, as in locate
+static void classify_packet(const BSP_tree* tree, const Vector3* points, size_t first,
+			    size_t last, unsigned char* inside, PointPacket& p)
+{
+  size_t n = last - first;
+  p.x.resize(n);
+  p.y.resize(n);
+  p.z.resize(n);
+  p.index.resize(n);
+  p.sides.resize(n);
+  for(size_t i = 0; i < n; i++){
+    p.x[i] = points[first + i].x;
+    p.y[i] = points[first + i].y;
+    p.z[i] = points[first + i].z;
+    p.index[i] = first + i;
+  }
+  p.stack.clear();
+  p.stack.push_back(PointRun(0, 0, n));
+  while(!p.stack.empty()){
+    PointRun run = p.stack.back();
+    p.stack.pop_back();
+    const BSP_node& node = tree->nodes[run.node];
+    classify_points(node.plane, EPSILON, &p.x[run.begin], &p.y[run.begin], &p.z[run.begin],
+		    run.end - run.begin, &p.sides[run.begin]);
+    size_t i = run.begin, j = run.end;
+    while(i < j){
+      if(p.sides[i] != FRONT){
+	i++;
 	continue;
       }
-      //we have to split the triangle
-      else{
-	//std::cout<<"Split"<<std::endl;
-	if(fa*fc>=0){
-	  swap(fb, fc);
-	  swap(b,c);
-	  swap(fa, fb);
-	  swap(a,b);
+      j--;
+      std::swap(p.x[i], p.x[j]);
+      std::swap(p.y[i], p.y[j]);
+      std::swap(p.z[i], p.z[j]);
+      std::swap(p.index[i], p.index[j]);
+      std::swap(p.sides[i], p.sides[j]);
+    }
+    for(int back = 0; back < 2; back++){
+      size_t begin = back ? run.begin : i, end = back ? i : run.end;
+      if(begin == end)
+	continue;
+      unsigned int child = back ? node.back : node.front;
+      if(is_node(child)){
+	p.stack.push_back(PointRun(child, begin, end));
+	continue;
+      }
+      unsigned char in = leaf_inside(child, back) ? 1 : 0;
+      for(size_t k = begin; k < end; k++){
+	inside[p.index[k]] = in;
+      }
+    }
+  }
+}
+
+//sets inside[i] to 1 if points[i] is inside the model of tree and to 0
+//if not, agreeing with point_inside. the points go down in packets of
+//PACKET_SIZE, each node's plane tested against all of a packet's
+//points reaching it at once with the vector kernels of classify.hpp,
+//and the packets are shared out over threads threads (0 for one per
+//core). points near each other in the array mostly take the same way
+//down, so ordered samples such as a voxel grid go fastest
+void classify_points(const BSP_tree* tree, const Vector3* points, size_t n,
+		     unsigned char* inside, int threads)
+{
+  if(tree->isempty()){
+    for(size_t i = 0; i < n; i++){
+      inside[i] = 0;
+    }
+    return;
+  }
+#ifdef OPENMP
+  if(threads <= 0)
+    threads = omp_get_max_threads();
+#endif
+  long packets = (n + PACKET_SIZE - 1) / PACKET_SIZE;
+#pragma omp parallel num_threads(threads)
+  {
+    PointPacket packet;
+#pragma omp for schedule(dynamic)
+    for(long i = 0; i < packets; i++){
+      size_t first = i * PACKET_SIZE;
+      classify_packet(tree, points, first, std::min(n, first + PACKET_SIZE), inside, packet);
+    }
+  }
+}
+
+//collects the triangles reaching the leaves of tree that merge has to
+//fill, tagged with the leaf as 2*node + back
+struct CellSink{
+  const BSP_tree* tree;
+  csg_type op;
+  std::vector<PendingTriangle>& cells;
+  Coplanar coplanar;
+  CellSink(const BSP_tree* tree, csg_type op, std::vector<PendingTriangle>& cells):
+    tree(tree), op(op), cells(cells), coplanar(op, false){}
+  void operator()(const Triangle& t, unsigned int node, bool back){
+    const BSP_node& parent = tree->nodes[node];
+    bool inside = leaf_inside(back ? parent.back : parent.front, back);
+    //the union fills the cells outside A, the others the ones inside it
+    if(inside == (op == CSG_UNION))
+      return;
+    Triangle piece = t;
+    //the difference keeps the inside of B turned inside out
+    if(op == CSG_DIFFERENCE)
+      std::swap(piece.vertices[1], piece.vertices[2]);
+    cells.push_back(PendingTriangle(2*node + (back ? 1 : 0), piece));
+  }
+};
+
+//whether the cell on the side away points to of the triangle t, which
+//bounds it, is inside the model of tree, for a cell no fragment of the
+//model's surface reaches and so lying wholly on one side of it. the
+//centroid of t is walked down the tree like locate does, going the way
+//away points at a plane it lies on, so a cell thinner than EPSILON is
+//still told apart from the one across t
+static bool cell_inside(const BSP_tree* tree, const std::vector<Vector3>& vertices,
+			const Triangle& t, const Vector3& away)
+{
+  Vector3 centroid = (vertices[t.vertices[0]] + vertices[t.vertices[1]] +
+		      vertices[t.vertices[2]]) / 3.0;
+  unsigned int root = 0;
+  while(true){
+    const BSP_node& node = tree->nodes[root];
+    float f = node.f(centroid);
+    bool back = fabs(f) < EPSILON ? dot(node.plane.normal, away) <= 0 : f < 0;
+    unsigned int child = back ? node.back : node.front;
+    if(!is_node(child))
+      return leaf_inside(child, back);
+    root = child;
+  }
+}
+
+//merges the solids of A and B into a new tree, without flattening and
+//rebuilding either of them. the result starts as a copy of A, whose
+//planes already tell A's inside from its outside:
+// - the triangles of A keep their nodes, cut down to the fragments
+//   that stay on the surface, or are hidden if none do
+// - every leaf of A whose side the operation leaves to B (the outside
+//   of A for a union, its inside otherwise) gets a subtree built from
+//   the fragments of B reaching it
+// - a leaf no fragment of B reaches lies wholly inside or outside of B,
+//   which the centroid of the triangle of its parent tells
+// - a face A and B share stays on the result at most once, see Coplanar
+//the result can be merged, queried or added to again like any tree
+BSP_tree* merge(const BSP_tree* A, const BSP_tree* B, csg_type op)
+{
+  std::vector<Triangle> B_list;
+  traverse(B, B_list);
+  return merge(A, B, B_list, op);
+}
+
+//merge with the surface of B, as traverse gives it, already at hand
+BSP_tree* merge(const BSP_tree* A, const BSP_tree* B, const std::vector<Triangle>& B_surface,
+		csg_type op)
+{
+  if(A->isempty() || B->isempty()){
+    if(op == CSG_INTERSECTION || A->isempty() == (op == CSG_DIFFERENCE))
+      return new BSP_tree();
+    return new BSP_tree(A->isempty() ? *B : *A);
+  }
+  BSP_tree* result = new BSP_tree(*A);
+  std::vector<Vector3>& vertices = result->vertices;
+  unsigned int A_size = A->size();
+
+  //the fragments of B, in the pool of the result
+  std::vector<Triangle> B_list(B_surface);
+  unsigned int base = vertices.size();
+  vertices.insert(vertices.end(), B->vertices.begin(), B->vertices.end());
+  for(size_t i = 0; i < B_list.size(); i++){
+    for(int j = 0; j < 3; j++){
+      B_list[i].vertices[j] += base;
+    }
+  }
+  std::vector<PendingTriangle> cells;
+  EdgeCache A_cache;
+  CellSink cell_sink(A, op, cells);
+  //every cell a fragment crosses needs its plane, so they are cut all
+  //the way down
+  descend(A, vertices, B_list, A_cache, false, cell_sink);
+  //groups the fragments by leaf, leaf id's being cells[first[id]] up to
+  //cells[first[id+1]]
+  std::vector<unsigned int> first(2*A_size + 1, 0);
+  for(size_t i = 0; i < cells.size(); i++){
+    first[cells[i].first + 1]++;
+  }
+  for(size_t i = 1; i < first.size(); i++){
+    first[i] += first[i-1];
+  }
+  std::vector<Triangle> grouped(cells.size());
+  std::vector<unsigned int> end(first.begin(), first.end()-1);
+  for(size_t i = 0; i < cells.size(); i++){
+    grouped[end[cells[i].first]++] = cells[i].second;
+  }
+
+  //the fragments of the triangles of A staying on the surface
+  std::vector<PendingTriangle> surface;
+  EdgeCache B_cache;
+  std::vector<Triangle> one(1), inside, outside;
+  for(unsigned int n = 0; n < A_size; n++){
+    if(result->nodes[n].hidden)
+      continue;
+    one[0] = result->nodes[n].triangle;
+    inside.clear();
+    outside.clear();
+    InsideOutside sink(B, &inside, &outside, Coplanar(op, true));
+    descend(B, vertices, one, B_cache, true, sink);
+    const std::vector<Triangle>& kept = op == CSG_INTERSECTION ? inside : outside;
+    for(size_t j = 0; j < kept.size(); j++){
+      surface.push_back(PendingTriangle(n, kept[j]));
+    }
+    if(kept.empty())
+      result->nodes[n].hidden = true;
+  }
+
+  //fills the leaves of A
+  BuildOptions options;
+  options.threads = 1;
+  for(unsigned int n = 0; n < A_size; n++){
+    for(int back = 0; back < 2; back++){
+      unsigned int leaf = back ? A->nodes[n].back : A->nodes[n].front;
+      if(is_node(leaf) || leaf_inside(leaf, back) == (op == CSG_UNION))
+	continue;
+      unsigned int id = 2*n + back;
+      if(first[id] < first[id+1]){
+	Fork fork;
+	fork.parent = n;
+	fork.front = !back;
+	fork.triangles.assign(grouped.begin() + first[id], grouped.begin() + first[id+1]);
+	gather(*result, fork);
+	fork.tree.build(fork.triangles, options);
+	graft(*result, fork);
+	continue;
+      }
+      const BSP_node& node = A->nodes[n];
+      Vector3 away = back ? -node.plane.normal : node.plane.normal;
+      bool in = cell_inside(B, A->vertices, node.triangle, away) != (op == CSG_DIFFERENCE);
+      unsigned int label = in == (bool)back ? BSP_NULL : in ? BSP_IN : BSP_OUT;
+      if(back)
+	result->nodes[n].back = label;
+      else
+	result->nodes[n].front = label;
+    }
+  }
+
+  //a triangle of A cut into several fragments keeps the first, the
+  //others going into nodes on the same plane chained in front of it
+  for(size_t i = 0; i < surface.size(); i++){
+    unsigned int n = surface[i].first;
+    if(i == 0 || surface[i-1].first != n){
+      result->nodes[n].triangle = surface[i].second;
+      continue;
+    }
+    result->nodes.push_back(BSP_node(surface[i].second, result->nodes[n].plane, n));
+    unsigned int chained = result->nodes.size()-1;
+    BSP_node& node = result->nodes[n];
+    result->nodes[chained].front = node.front;
+    if(is_node(node.front))
+      result->nodes[node.front].parent = chained;
+    node.front = chained;
+  }
+  result->bound();
+  return result;
+}
+
+//most cells a surface grid is cut into along each axis
+#define MAX_GRID 64
+
+//a grid over the box where the surface of a tree can meet the other
+//operand, marking the cells its triangles pass through. a triangle
+//touching none of them can't cross the surface, so it lies wholly on
+//the side of any point in the cells around it, which is looked up
+//once per cell as it is needed
+class SurfaceGrid{
+public:
+  enum{UNKNOWN, INSIDE, OUTSIDE, SURFACE};
+  SurfaceGrid(const BSP_tree* tree, const std::vector<Triangle>& surface,
+	      const Bounds& other):
+    tree(tree)
+  {
+    outer = tree->nodes[0].bounds;
+    Vector3 slack(2*EPSILON, 2*EPSILON, 2*EPSILON);
+    region.lo = vmax(outer.lo, other.lo) - slack;
+    region.hi = vmin(outer.hi, other.hi) + slack;
+    //about one triangle of the surface per cell
+    size_t n = std::max((size_t)1, std::min((size_t)MAX_GRID,
+					     (size_t)cbrt((double)surface.size())));
+    for(int k = 0; k < 3; k++){
+      size[k] = n;
+      scale[k] = n / std::max(region.hi[k] - region.lo[k], (float)EPSILON);
+    }
+    cells.assign(n*n*n, UNKNOWN);
+    exterior = UNKNOWN;
+    const std::vector<Vector3>& vertices = tree->vertices;
+    for(size_t i = 0; i < surface.size(); i++){
+      size_t lo[3], hi[3];
+      if(!range(box(vertices, surface[i]), lo, hi))
+	continue;
+      for(size_t x = lo[0]; x <= hi[0]; x++)
+	for(size_t y = lo[1]; y <= hi[1]; y++)
+	  for(size_t z = lo[2]; z <= hi[2]; z++)
+	    cells[index(x, y, z)] = SURFACE;
+    }
+  }
+  //INSIDE or OUTSIDE if the triangle t, indexing vertices, keeps clear
+  //of the surface, else SURFACE
+  int place(const std::vector<Vector3>& vertices, const Triangle& t){
+    Bounds b = box(vertices, t);
+    if(!outer.overlaps(b, 2*EPSILON)){
+      if(exterior == UNKNOWN)
+	exterior = label(outer.hi + Vector3(1.0, 1.0, 1.0));
+      return exterior;
+    }
+    size_t lo[3], hi[3];
+    if(!range(b, lo, hi))
+      return SURFACE;
+    for(size_t x = lo[0]; x <= hi[0]; x++)
+      for(size_t y = lo[1]; y <= hi[1]; y++)
+	for(size_t z = lo[2]; z <= hi[2]; z++)
+	  if(cells[index(x, y, z)] == SURFACE)
+	    return SURFACE;
+    unsigned char& cell = cells[index(lo[0], lo[1], lo[2])];
+    if(cell == UNKNOWN){
+      Vector3 center;
+      for(int k = 0; k < 3; k++){
+	center[k] = region.lo[k] + (lo[k] + 0.5) / scale[k];
+      }
+      cell = label(center);
+    }
+    return cell;
+  }
+private:
+  const BSP_tree* tree;
+  Bounds outer;
+  Bounds region;
+  size_t size[3];
+  float scale[3];
+  std::vector<unsigned char> cells;
+  unsigned char exterior;
+  static Bounds box(const std::vector<Vector3>& vertices, const Triangle& t){
+    Bounds b;
+    for(int j = 0; j < 3; j++){
+      b.include(vertices[t.vertices[j]]);
+    }
+    return b;
+  }
+  inline size_t index(size_t x, size_t y, size_t z) const{
+    return (x*size[1] + y)*size[2] + z;
+  }
+  //the cells within a little of b, false if there are none. the
+  //region is empty when the operands are apart
+  bool range(const Bounds& b, size_t lo[3], size_t hi[3]) const{
+    if(region.lo.x > region.hi.x || region.lo.y > region.hi.y ||
+       region.lo.z > region.hi.z || !region.overlaps(b, 2*EPSILON))
+      return false;
+    for(int k = 0; k < 3; k++){
+      float l = (b.lo[k] - 2*EPSILON - region.lo[k]) * scale[k];
+      float h = (b.hi[k] + 2*EPSILON - region.lo[k]) * scale[k];
+      lo[k] = l <= 0 ? 0 : std::min(size[k]-1, (size_t)l);
+      hi[k] = h <= 0 ? 0 : std::min(size[k]-1, (size_t)h);
+    }
+    return true;
+  }
+  unsigned char label(const Vector3& p) const{
+    bool back;
+    const BSP_node& node = tree->nodes[locate(tree, 0, p, back)];
+    return leaf_inside(back ? node.back : node.front, back) ? INSIDE : OUTSIDE;
+  }
+};
+
+//moves the triangles of list that keep clear of surface, the triangles
+//of tree, straight to inside or outside, leaving in list the ones that
+//have to be pushed through tree. bounds is the box of the operand the
+//list comes from, and vertices the pool it indexes
+static void cull(const BSP_tree* tree, const std::vector<Triangle>& surface,
+		 const Bounds& bounds, const std::vector<Vector3>& vertices,
+		 std::vector<Triangle>& list, std::vector<Triangle>& inside,
+		 std::vector<Triangle>& outside)
+{
+  if(tree->isempty())
+    return;
+  SurfaceGrid grid(tree, surface, bounds);
+  size_t kept = 0;
+  for(size_t i = 0; i < list.size(); i++){
+    switch(grid.place(vertices, list[i])){
+    case SurfaceGrid::INSIDE: inside.push_back(list[i]); break;
+    case SurfaceGrid::OUTSIDE: outside.push_back(list[i]); break;
+    default: list[kept++] = list[i]; break;
+    }
+  }
+  list.resize(kept);
+}
+
+//box of the triangles of tree, empty for an empty tree
+static Bounds bounds(const BSP_tree* tree){
+  return tree->isempty() ? Bounds() : tree->nodes[0].bounds;
+}
+
+//sorts the surface of A into the fragments lying inside and outside B,
+//keeping those on the sides asked for, on threads threads. vertices is
+//set to a copy of the pool of A with the split points after it
+static void clip(const BSP_tree* A, const BSP_tree* B, bool keep_inside, bool keep_outside,
+		 std::vector<Vector3>& vertices, std::vector<Triangle>& inside,
+		 std::vector<Triangle>& outside, int threads)
+{
+  std::vector<Triangle> triangles, surface;
+  traverse(A, triangles);
+  traverse(B, surface);
+  cull(B, surface, bounds(A), A->vertices, triangles, inside, outside);
+  if(!keep_inside)
+    inside.clear();
+  if(!keep_outside)
+    outside.clear();
+  vertices = A->vertices;
+  std::vector<Shard> shards;
+  shard(B, vertices, triangles, keep_inside, keep_outside, threads, shards);
+  run(shards, threads);
+  join(shards, 0, shards.size(), vertices, inside, outside);
+}
+
+//like merge_trees(A, B, threads) with only the list of op filled in,
+//each surface only pushed through the tree it is clipped by and only
+//the fragments op keeps held on to
+CSGResult merge_trees(const BSP_tree* A, const BSP_tree* B, render_type op, int threads)
+{
+#ifdef OPENMP
+  if(threads <= 0)
+    threads = omp_get_max_threads();
+#endif
+  std::vector<Vector3> A_vertices, B_vertices;
+  std::vector<Triangle> A_list, A_in, A_out, B_list, B_in, B_out;
+  switch(op){
+  case AONLY:
+    A_vertices = A->vertices;
+    traverse(A, A_list);
+    break;
+  case BONLY:
+    B_vertices = B->vertices;
+    traverse(B, B_list);
+    break;
+  case ANOTB: clip(A, B, false, true, A_vertices, A_in, A_out, threads); break;
+  case BNOTA: clip(B, A, false, true, B_vertices, B_in, B_out, threads); break;
+  case AUNIONB:
+    clip(A, B, true, false, A_vertices, A_in, A_out, threads);
+    clip(B, A, true, false, B_vertices, B_in, B_out, threads);
+    break;
+  case APLUSB:
+    clip(A, B, false, true, A_vertices, A_in, A_out, threads);
+    clip(B, A, false, true, B_vertices, B_in, B_out, threads);
+    break;
+  default: break;
+  }
+  CSGResult result;
+  result.assign(A_vertices, A_list, A_in, A_out, B_vertices, B_list, B_in, B_out);
+  return result;
+}
+
+CSGResult merge_trees(const BSP_tree* A, const BSP_tree* B, render_type op)
+{
+  return merge_trees(A, B, op, 1);
+}
+
+//whether some of the surface of A lies inside the model of B. only the
+//triangles of A near the box of B are pushed through it, each going
+//down on its own so the search stops at the first fragment to land in
+//an inside leaf. a fragment lying on a plane of B that faces the other
+//way is on a face the models only touch across, so it is dropped
+static bool surface_inside(const BSP_tree* A, const BSP_tree* B)
+{
+  const Bounds& box = B->nodes[0].bounds;
+  //where A is clear of the box of B it is wherever the space around B is
+  bool exterior = point_inside(B, box.hi + Vector3(1.0, 1.0, 1.0));
+  //the corners of the triangles that have to go down B, unshared, as
+  //they are only classified and never output
+  std::vector<Vector3> vertices;
+  std::vector<PendingTriangle> stack;
+  std::vector<unsigned int> nodes(1, 0);
+  while(!nodes.empty()){
+    const BSP_node& node = A->nodes[nodes.back()];
+    nodes.pop_back();
+    if(!node.bounds.overlaps(box, 2*EPSILON)){
+      if(exterior)
+	return true;
+      continue;
+    }
+    if(!node.hidden){
+      Bounds b;
+      for(int j = 0; j < 3; j++){
+	b.include(A->vertices[node.triangle.vertices[j]]);
+      }
+      if(!box.overlaps(b, 2*EPSILON)){
+	if(exterior)
+	  return true;
+      }else{
+	Triangle t;
+	for(int j = 0; j < 3; j++){
+	  t.vertices[j] = vertices.size();
+	  vertices.push_back(A->vertices[node.triangle.vertices[j]]);
+	}
+	stack.push_back(PendingTriangle(0, t));
+      }
+    }
+    if(is_node(node.front)) nodes.push_back(node.front);
+    if(is_node(node.back)) nodes.push_back(node.back);
+  }
+  EdgeCache cache;
+  std::vector<Triangle> front, back;
+  float fa, fb, fc;
+  while(!stack.empty()){
+    unsigned int root = stack.back().first;
+    Triangle t = stack.back().second;
+    stack.pop_back();
+    const Vector3& a = vertices[t.vertices[0]];
+    const Vector3& b = vertices[t.vertices[1]];
+    const Vector3& c = vertices[t.vertices[2]];
+    Bounds fragment;
+    fragment.include(a);
+    fragment.include(b);
+    fragment.include(c);
+    while(true){
+      const BSP_node& node = B->nodes[root];
+      if(!node.bounds.overlaps(fragment, 2*EPSILON)){
+	bool behind;
+	const BSP_node& parent = B->nodes[locate(B, root, (a + b + c) / 3.0, behind)];
+	if(leaf_inside(behind ? parent.back : parent.front, behind))
+	  return true;
+	break;
+      }
+      classify(node.plane, vertices, t, fa, fb, fc);
+      int s = side(fa, fb, fc);
+      if(s == SPANNING){
+	front.clear();
+	back.clear();
+	split(t, fa, fb, fc, root, vertices, cache, front, back);
+	for(size_t j = 0; j < front.size(); j++){
+	  if(is_node(node.front))
+	    stack.push_back(PendingTriangle(node.front, front[j]));
+	  else if(leaf_inside(node.front, false))
+	    return true;
+	}
+	for(size_t j = 0; j < back.size(); j++){
+	  if(is_node(node.back))
+	    stack.push_back(PendingTriangle(node.back, back[j]));
+	  else if(leaf_inside(node.back, true))
+	    return true;
 	}
-	else if(fb*fc>=0){
-	  swap(fa,fc);
-	  swap(a,c);
-	  swap(fa,fb);
-	  swap(a,b);
+	break;
+      }
+      if(s == COPLANAR && dot(node.plane.normal, cross(b - a, c - a)) < 0)
+	break;
+      bool behind = s != FRONT;
+      unsigned int child = behind ? node.back : node.front;
+      if(!is_node(child)){
+	if(leaf_inside(child, behind))
+	  return true;
+	break;
+      }
+      root = child;
+    }
+  }
+  return false;
+}
+
+//whether the models of A and B overlap, that is some of the surface of
+//either lies inside the other, the same as A in B or B in A of
+//merge_trees coming out non-empty except for faces the two only touch
+//across. it builds no lists and stops as soon as it has an answer
+bool intersects(const BSP_tree* A, const BSP_tree* B)
+{
+  if(A->isempty() || B->isempty())
+    return false;
+  return surface_inside(A, B) || surface_inside(B, A);
+}
+
+MassProperties::MassProperties():volume(0.0), area(0.0), centroid(0, 0, 0){
+  for(int i = 0; i < 3; i++){
+    for(int j = 0; j < 3; j++){
+      inertia[i][j] = 0.0;
+    }
+  }
+}
+
+//running sums over a closed surface of the integrals of 1, x, y, z,
+//x^2, y^2, z^2, xy, yz and zx over the volume it encloses, turned into
+//surface integrals by the divergence theorem so each triangle adds its
+//share on its own. coordinates are taken from origin, near the solid,
+//to keep the squares from swamping the differences
+struct MassSums{
+  Vector3 origin;
+  double sums[10];
+  double area;
+  MassSums():origin(0, 0, 0), area(0.0){
+    for(int i = 0; i < 10; i++) sums[i] = 0.0;
+  }
+  //adds the triangle (p, q, r), facing the other way if sign is -1
+  void add(const Vector3& p, const Vector3& q, const Vector3& r, double sign){
+    double x[3], y[3], z[3];
+    const Vector3* v[3] = {&p, &q, &r};
+    for(int k = 0; k < 3; k++){
+      x[k] = (*v[k]).x - origin.x;
+      y[k] = (*v[k]).y - origin.y;
+      z[k] = (*v[k]).z - origin.z;
+    }
+    double ux = x[1]-x[0], uy = y[1]-y[0], uz = z[1]-z[0];
+    double wx = x[2]-x[0], wy = y[2]-y[0], wz = z[2]-z[0];
+    double dx = uy*wz - uz*wy, dy = uz*wx - ux*wz, dz = ux*wy - uy*wx;
+    area += 0.5 * sqrt(dx*dx + dy*dy + dz*dz);
+    dx *= sign;
+    dy *= sign;
+    dz *= sign;
+    double f1[3], f2[3], f3[3], g[3][3];
+    terms(x, f1[0], f2[0], f3[0], g[0]);
+    terms(y, f1[1], f2[1], f3[1], g[1]);
+    terms(z, f1[2], f2[2], f3[2], g[2]);
+    sums[0] += dx*f1[0];
+    sums[1] += dx*f2[0];
+    sums[2] += dy*f2[1];
+    sums[3] += dz*f2[2];
+    sums[4] += dx*f3[0];
+    sums[5] += dy*f3[1];
+    sums[6] += dz*f3[2];
+    sums[7] += dx*(y[0]*g[0][0] + y[1]*g[0][1] + y[2]*g[0][2]);
+    sums[8] += dy*(z[0]*g[1][0] + z[1]*g[1][1] + z[2]*g[1][2]);
+    sums[9] += dz*(x[0]*g[2][0] + x[1]*g[2][1] + x[2]*g[2][2]);
+  }
+  void add(const MassSums& other){
+    for(int i = 0; i < 10; i++) sums[i] += other.sums[i];
+    area += other.area;
+  }
+  //the polynomials of one coordinate of the corners the sums are
+  //built from
+  static inline void terms(const double w[3], double& f1, double& f2, double& f3,
+			   double g[3]){
+    double t0 = w[0] + w[1];
+    double t1 = w[0]*w[0];
+    double t2 = t1 + w[1]*t0;
+    f1 = t0 + w[2];
+    f2 = t2 + w[2]*f1;
+    f3 = w[0]*t1 + w[1]*t2 + w[2]*f2;
+    for(int k = 0; k < 3; k++){
+      g[k] = f2 + w[k]*(f1 + w[k]);
+    }
+  }
+  MassProperties properties() const{
+    MassProperties m;
+    m.area = area;
+    m.volume = sums[0] / 6.0;
+    if(m.volume == 0.0){
+      m.centroid = origin;
+      return m;
+    }
+    double c[3];
+    for(int k = 0; k < 3; k++){
+      c[k] = sums[1+k] / 24.0 / m.volume;
+    }
+    double xx = sums[4] / 60.0, yy = sums[5] / 60.0, zz = sums[6] / 60.0;
+    double xy = sums[7] / 120.0, yz = sums[8] / 120.0, zx = sums[9] / 120.0;
+    double v = m.volume;
+    m.inertia[0][0] = yy + zz - v*(c[1]*c[1] + c[2]*c[2]);
+    m.inertia[1][1] = zz + xx - v*(c[2]*c[2] + c[0]*c[0]);
+    m.inertia[2][2] = xx + yy - v*(c[0]*c[0] + c[1]*c[1]);
+    m.inertia[0][1] = m.inertia[1][0] = -(xy - v*c[0]*c[1]);
+    m.inertia[1][2] = m.inertia[2][1] = -(yz - v*c[1]*c[2]);
+    m.inertia[2][0] = m.inertia[0][2] = -(zx - v*c[2]*c[0]);
+    m.centroid = origin + Vector3(c[0], c[1], c[2]);
+    return m;
+  }
+};
+
+//adds the triangles reaching the leaves of tree to sums, those landing
+//inside the model with sign inside and those outside with sign outside,
+//a sign of 0 leaving them out
+struct MassSink{
+  const BSP_tree* tree;
+  const SplitPool& vertices;
+  double inside;
+  double outside;
+  MassSums& sums;
+  Coplanar coplanar;
+  MassSink(const BSP_tree* tree, const SplitPool& vertices, double inside,
+	   double outside, MassSums& sums, const Coplanar& coplanar):
+    tree(tree), vertices(vertices), inside(inside), outside(outside), sums(sums),
+    coplanar(coplanar){}
+  void operator()(const Triangle& t, unsigned int node, bool back){
+    const BSP_node& parent = tree->nodes[node];
+    add(t, leaf_inside(back ? parent.back : parent.front, back));
+  }
+  void add(const Triangle& t, bool in){
+    double sign = in ? inside : outside;
+    if(sign != 0.0)
+      sums.add(vertices[t.vertices[0]], vertices[t.vertices[1]],
+	       vertices[t.vertices[2]], sign);
+  }
+};
+
+//adds the surface of one operand to sums[0], clipped by the tree of
+//the other. list is its triangles, indexing vertices, and other the
+//triangles of tree. what the grid can place goes straight in, and the
+//rest is cut into shards, each summed into its own entry of sums
+static void sum(const BSP_tree* tree, const std::vector<Triangle>& other,
+		const Bounds& box, const std::vector<Vector3>& vertices,
+		const std::vector<Triangle>& list, double inside, double outside,
+		const Coplanar& coplanar, int threads, std::vector<Shard>& shards,
+		std::vector<MassSums>& sums)
+{
+  SplitPool pool(vertices);
+  MassSink sink(tree, pool, inside, outside, sums[0], coplanar);
+  if(tree->isempty()){
+    for(size_t i = 0; i < list.size(); i++){
+      sink.add(list[i], false);
+    }
+    return;
+  }
+  std::vector<Triangle> rest;
+  SurfaceGrid grid(tree, other, box);
+  for(size_t i = 0; i < list.size(); i++){
+    switch(grid.place(vertices, list[i])){
+    case SurfaceGrid::INSIDE: sink.add(list[i], true); break;
+    case SurfaceGrid::OUTSIDE: sink.add(list[i], false); break;
+    default: rest.push_back(list[i]); break;
+    }
+  }
+  size_t first = shards.size();
+  shard(tree, vertices, rest, inside != 0.0, outside != 0.0, threads, shards);
+  sums.resize(shards.size() + 1, MassSums());
+  for(size_t i = first; i < shards.size(); i++){
+    shards[i].coplanar = coplanar;
+    sums[i+1].origin = sums[0].origin;
+  }
+}
+
+//volume, area, centroid and inertia of the result of op on the models
+//of A and B, summed fragment by fragment as they come out of the trees
+//without any of them being kept. the fragments are pushed through the
+//trees on threads threads (0 for one per core), each summing into its
+//own accumulator
+MassProperties mass_properties(const BSP_tree* A, const BSP_tree* B, csg_type op,
+			       int threads)
+{
+#ifdef OPENMP
+  if(threads <= 0)
+    threads = omp_get_max_threads();
+#endif
+  //A keeps what lies outside B unless intersecting, B keeps what lies
+  //inside A when intersecting or, turned inside out, when subtracting
+  double A_in = op == CSG_INTERSECTION ? 1.0 : 0.0;
+  double A_out = 1.0 - A_in;
+  double B_in = op == CSG_UNION ? 0.0 : op == CSG_INTERSECTION ? 1.0 : -1.0;
+  double B_out = op == CSG_UNION ? 1.0 : 0.0;
+  std::vector<Triangle> A_list, B_list;
+  traverse(A, A_list);
+  traverse(B, B_list);
+  Bounds box = bounds(A);
+  box.include(bounds(B));
+  std::vector<MassSums> sums(1);
+  if(!A_list.empty() || !B_list.empty())
+    sums[0].origin = (box.lo + box.hi) / 2.0;
+  std::vector<Shard> shards;
+  sum(B, B_list, bounds(A), A->vertices, A_list, A_in, A_out, Coplanar(op, true),
+      threads, shards, sums);
+  size_t A_shards = shards.size();
+  sum(A, A_list, bounds(B), B->vertices, B_list, B_in, B_out, Coplanar(op, false),
+      threads, shards, sums);
+
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+  for(int i = 0; i < (int)shards.size(); i++){
+    Shard& s = shards[i];
+    //split points are only needed while the shard is summed
+    SplitPool vertices(*s.pool);
+    bool A_side = (size_t)i < A_shards;
+    EdgeCache cache;
+    MassSink sink(s.tree, vertices, A_side ? A_in : B_in, A_side ? A_out : B_out,
+		  sums[i+1], s.coplanar);
+    descend(s.tree, vertices, s.triangles, cache, true, sink);
+  }
+  //adding up in shard order gives the same result on any number of
+  //threads
+  for(size_t i = 1; i < sums.size(); i++){
+    sums[0].add(sums[i]);
+  }
+  return sums[0].properties();
+}
+//a convex polygon of coalesce, as the loop of triangle edges around it
+struct Facet{
+  std::vector<unsigned int> loop;
+  Vector3 normal;
+  bool alive;
+};
+
+//a corner of coalesce as where it is and its index, sorting by place
+struct Corner{
+  Vector3 p;
+  unsigned int index;
+  inline bool operator<(const Corner& rhs) const{
+    if(p.x != rhs.p.x) return p.x < rhs.p.x;
+    if(p.y != rhs.p.y) return p.y < rhs.p.y;
+    if(p.z != rhs.p.z) return p.z < rhs.p.z;
+    return index < rhs.index;
+  }
+};
+
+//whether the corner a, b, c of a polygon facing normal turns the
+//wrong way or doubles back, a straight corner being fine
+static inline bool reflex(const Vector3& a, const Vector3& b, const Vector3& c,
+			  const Vector3& normal)
+{
+  Vector3 u = b - a;
+  Vector3 v = c - b;
+  float turn = dot(cross(u, v), normal);
+  float scale = 1e-6 * length(u) * length(v);
+  return turn < -scale || (turn <= scale && dot(u, v) <= 0);
+}
+
+//whether the triangle a, b, c has next to no area, its corner at b
+//hardly turning
+static inline bool thin(const Vector3& a, const Vector3& b, const Vector3& c)
+{
+  Vector3 u = b - a;
+  Vector3 v = c - b;
+  return length(cross(u, v)) <= 1e-6 * length(u) * length(v);
+}
+
+//whether b lies on the line from a to c
+static inline bool straight(const Vector3& a, const Vector3& b, const Vector3& c)
+{
+  return thin(a, b, c) && dot(b - a, c - b) > 0;
+}
+
+//the facet that took in facet f
+static unsigned int owner(std::vector<unsigned int>& merged, unsigned int f){
+  while(merged[f] != f){
+    merged[f] = merged[merged[f]];
+    f = merged[f];
+  }
+  return f;
+}
+
+//merges the triangles of the list into fewer, larger ones. each split
+//cuts a triangle in three, so the fragments of a boolean hold many
+//pieces of the same plane. triangles facing the same way and sharing an
+//edge are joined into convex polygons, which are then fanned out again
+//without their straight corners, so a polygon of n corners goes back as
+//n-2 triangles. points at the same place are welded first, as the
+//pieces may come from different pools. no point is moved or added, and
+//the area covered stays the same, though a corner dropped from one
+//polygon can be left on the edge of a neighbour on another plane the
+//way splits already leave them. a polygon is fanned from the first of
+//its corners that gives no thin triangle, and one with no such corner
+//goes back as the triangles it was made of.
+//edge 3*t + k runs from corner k of triangle t to the next one, and a
+//polygon is the loop of the edges around it, each starting at a corner
+void coalesce(const std::vector<Vector3>& vertices, std::vector<Triangle>& triangles)
+{
+  size_t n = triangles.size();
+  //welds the corners, point[c] being the welded point at corner c and
+  //original[p] the pool index standing for point p
+  std::vector<Corner> corners(3*n);
+  std::vector<unsigned int> point(3*n), original;
+  for(size_t c = 0; c < 3*n; c++){
+    const Vector3& p = vertices[triangles[c/3].vertices[c%3]];
+    corners[c].p = p;
+    corners[c].index = c;
+  }
+  std::sort(corners.begin(), corners.end());
+  for(size_t i = 0; i < corners.size(); i++){
+    unsigned int c = corners[i].index;
+    if(i == 0 || corners[i-1].p != corners[i].p)
+      original.push_back(triangles[c/3].vertices[c%3]);
+    point[c] = original.size()-1;
+  }
+  std::vector<Corner>().swap(corners);
+
+  std::vector<Facet> facets(n);
+  //the triangles taken into facet f are f, next[f], next[next[f]] and
+  //so on up to last[f]
+  std::vector<unsigned int> merged(n), next(n, BSP_NULL), last(n);
+  for(size_t t = 0; t < n; t++){
+    Facet& f = facets[t];
+    merged[t] = t;
+    last[t] = t;
+    const Vector3& a = vertices[original[point[3*t]]];
+    Vector3 normal = cross(vertices[original[point[3*t+1]]] - a,
+			   vertices[original[point[3*t+2]]] - a);
+    float len = length(normal);
+    f.alive = len > 0 && point[3*t] != point[3*t+1] && point[3*t+1] != point[3*t+2] &&
+      point[3*t+2] != point[3*t];
+    f.normal = f.alive ? normal/len : Vector3::Zero();
+    if(f.alive){
+      f.loop.resize(3);
+      for(int k = 0; k < 3; k++){
+	f.loop[k] = 3*t + k;
+      }
+    }
+  }
+  //pairs each edge with the one running the other way along it, if
+  //that is the only other edge there
+  std::vector<unsigned int> twin(3*n, BSP_NULL);
+  //edges keyed by the points they join, the lower one first
+  std::vector<std::pair<unsigned long long, unsigned int> > edges;
+  edges.reserve(3*n);
+  for(size_t t = 0; t < n; t++){
+    if(!facets[t].alive)
+      continue;
+    for(int k = 0; k < 3; k++){
+      unsigned long long a = point[3*t + k], b = point[3*t + (k+1)%3];
+      edges.push_back(std::make_pair(a < b ? a << 32 | b : b << 32 | a, 3*t + k));
+    }
+  }
+  std::sort(edges.begin(), edges.end());
+  for(size_t i = 0; i+1 < edges.size(); i++){
+    unsigned long long key = edges[i].first;
+    if(edges[i+1].first != key || (i+2 < edges.size() && edges[i+2].first == key) ||
+       (i > 0 && edges[i-1].first == key))
+      continue;
+    unsigned int e = edges[i].second, f = edges[i+1].second;
+    //both running the same way means the facets face apart
+    if(point[e] == point[f])
+      continue;
+    twin[e] = f;
+    twin[f] = e;
+  }
+  std::vector<std::pair<unsigned long long, unsigned int> >().swap(edges);
+
+  //grows each facet in turn by any neighbour across one of its edges
+  //that lies on the same plane and keeps it convex, walking round the
+  //loop until every edge has failed since the last one taken in
+  std::vector<unsigned int> path;
+  for(size_t i = 0; i < n; i++){
+    Facet& f = facets[i];
+    if(!f.alive)
+      continue;
+    std::vector<unsigned int>& P = f.loop;
+    for(size_t k = 0, misses = 0; misses < P.size(); k = (k+1)%P.size(), misses++){
+      unsigned int e = twin[P[k]];
+      if(e == BSP_NULL)
+	continue;
+      unsigned int j = owner(merged, e/3);
+      Facet& g = facets[j];
+      if(j == i || dot(f.normal, g.normal) < 0.99999f)
+	continue;
+      //the edges of g after the shared one, starting at the same corner
+      //as the edge they replace and ending where it ends
+      const std::vector<unsigned int>& Q = g.loop;
+      size_t at = std::find(Q.begin(), Q.end(), e) - Q.begin();
+      path.clear();
+      for(size_t m = 1; m < Q.size(); m++){
+	path.push_back(Q[(at+m)%Q.size()]);
+      }
+      //a second shared corner would fold the polygon over itself
+      bool shared = false;
+      for(size_t m = 1; m < path.size() && !shared; m++){
+	for(size_t l = 0; l < P.size() && !shared; l++){
+	  shared = point[P[l]] == point[path[m]];
 	}
-	Vector3 A =intersect(root->triangle.normal(), root->triangle.vertices[0], a, c);
-	Vector3 B =intersect(root->triangle.normal(), root->triangle.vertices[0], b, c);
-	TreeTriangle T1(a,b,A);
-	TreeTriangle T2(b,B,A);
-	TreeTriangle T3(A,B,c);
-	to_add.push_back(T1);
-	to_add.push_back(T2);
-	to_add.push_back(T3);
+      }
+      if(shared)
+	continue;
+      const Vector3& before = vertices[original[point[P[(k+P.size()-1)%P.size()]]]];
+      const Vector3& u = vertices[original[point[P[k]]]];
+      const Vector3& v = vertices[original[point[P[(k+1)%P.size()]]]];
+      const Vector3& after = vertices[original[point[P[(k+2)%P.size()]]]];
+      if(reflex(before, u, vertices[original[point[path[1]]]], f.normal) ||
+	 reflex(vertices[original[point[path.back()]]], v, after, f.normal))
+	continue;
+      P[k] = path[0];
+      P.insert(P.begin() + k + 1, path.begin() + 1, path.end());
+      std::vector<unsigned int>().swap(g.loop);
+      g.alive = false;
+      merged[j] = i;
+      next[last[i]] = j;
+      last[i] = last[j];
+      //tries the new edge out of u next
+      k = (k+P.size()-1)%P.size();
+      misses = (size_t)-1;
+    }
+  }
+
+  std::vector<Triangle> list;
+  list.reserve(n);
+  std::vector<unsigned int> kept;
+  for(size_t i = 0; i < n; i++){
+    const Facet& f = facets[i];
+    if(!f.alive)
+      continue;
+    const std::vector<unsigned int>& P = f.loop;
+    kept.clear();
+    for(size_t k = 0; k < P.size(); k++){
+      unsigned int a = original[point[P[(k+P.size()-1)%P.size()]]];
+      unsigned int b = original[point[P[k]]];
+      unsigned int c = original[point[P[(k+1)%P.size()]]];
+      if(!straight(vertices[a], vertices[b], vertices[c]))
+	kept.push_back(b);
+    }
+    size_t m = kept.size(), apex = 0;
+    for(; apex < m; apex++){
+      size_t k = 1;
+      while(k+1 < m && !thin(vertices[kept[apex]], vertices[kept[(apex+k)%m]],
+			     vertices[kept[(apex+k+1)%m]]))
+	k++;
+      if(k+1 >= m)
 	break;
+    }
+    if(apex == m){
+      for(unsigned int t = i; t != BSP_NULL; t = next[t]){
+	list.push_back(triangles[t]);
       }
-    } 
+      continue;
+    }
+    for(size_t k = 1; k+1 < m; k++){
+      Triangle t;
+      t.vertices[0] = kept[apex];
+      t.vertices[1] = kept[(apex+k)%m];
+      t.vertices[2] = kept[(apex+k+1)%m];
+      list.push_back(t);
+    }
+  }
+  triangles.swap(list);
+}
+
+CSGResult::CSGResult(){
+  for(int op = 0; op < DEFAULT; op++){
+    first[op] = last[op] = 0;
+  }
+}
+
+//leaves other empty
+CSGResult::CSGResult(CSGResult&& other):
+  pool(std::move(other.pool)), triangles(std::move(other.triangles)){
+  for(int op = 0; op < DEFAULT; op++){
+    first[op] = other.first[op];
+    last[op] = other.last[op];
+    other.first[op] = other.last[op] = 0;
   }
-  
-  
+  other.pool.clear();
+  other.triangles.clear();
 }
 
+//hands the old contents of this result to other, which is about to go
+CSGResult& CSGResult::operator=(CSGResult&& other){
+  pool.swap(other.pool);
+  triangles.swap(other.triangles);
+  for(int op = 0; op < DEFAULT; op++){
+    std::swap(first[op], other.first[op]);
+    std::swap(last[op], other.last[op]);
+  }
+  return *this;
+}
+
+//appends the triangles of list to the arena, moving their indices by
+//offset, and returns where they start
+static size_t append(std::vector<Triangle>& arena, const std::vector<Triangle>& list,
+		     unsigned int offset)
+{
+  size_t start = arena.size();
+  for(size_t i = 0; i < list.size(); i++){
+    Triangle t = list[i];
+    for(int k = 0; k < 3; k++){
+      t.vertices[k] += offset;
+    }
+    arena.push_back(t);
+  }
+  return start;
+}
 
-std::vector<TreeTriangle>* merge_trees(BSP_tree* A, BSP_tree* B){
-  std::vector<TreeTriangle> * list = new std::vector<TreeTriangle>[6];
-  std::vector<TreeTriangle> A_list, B_list;
+void CSGResult::assign(std::vector<Vector3>& A_vertices, const std::vector<Triangle>& A_list,
+		       const std::vector<Triangle>& A_in, const std::vector<Triangle>& A_out,
+		       std::vector<Vector3>& B_vertices, const std::vector<Triangle>& B_list,
+		       const std::vector<Triangle>& B_in, const std::vector<Triangle>& B_out)
+{
+  pool.clear();
+  pool.swap(A_vertices);
+  unsigned int offset = pool.size();
+  pool.insert(pool.end(), B_vertices.begin(), B_vertices.end());
+  std::vector<Vector3>().swap(B_vertices);
+  triangles.clear();
+  triangles.reserve(A_list.size() + B_list.size() + A_in.size() + B_in.size() +
+		    A_out.size() + B_out.size());
+  first[AONLY] = append(triangles, A_list, 0);
+  first[BONLY] = last[AONLY] = append(triangles, B_list, offset);
+  first[AUNIONB] = last[BONLY] = append(triangles, A_in, 0);
+  append(triangles, B_in, offset);
+  first[APLUSB] = first[BNOTA] = last[AUNIONB] = append(triangles, B_out, offset);
+  first[ANOTB] = last[BNOTA] = append(triangles, A_out, 0);
+  last[ANOTB] = last[APLUSB] = triangles.size();
+}
+
+const Triangle* CSGResult::begin(render_type op) const{
+  return triangles.empty() ? NULL : &triangles[0] + first[op];
+}
+
+const Triangle* CSGResult::end(render_type op) const{
+  return triangles.empty() ? NULL : &triangles[0] + last[op];
+}
+
+size_t CSGResult::size(render_type op) const{
+  return last[op] - first[op];
+}
+
+TreeTriangle CSGResult::triangle(render_type op, size_t i) const{
+  const Triangle& t = triangles[first[op] + i];
+  return TreeTriangle(pool[t.vertices[0]], pool[t.vertices[1]], pool[t.vertices[2]]);
+}
+
+//the lists of the arena, as the runs between these bounds. A in B and
+//B in A are only ever used together, so they count as one
+void CSGResult::coalesce(int threads){
+#ifdef OPENMP
+  if(threads <= 0)
+    threads = omp_get_max_threads();
+#endif
+  size_t bounds[6] = {first[AONLY], first[BONLY], first[AUNIONB], first[BNOTA],
+		      first[ANOTB], last[ANOTB]};
+  std::vector<Triangle> lists[5];
+  for(int i = 0; i < 5; i++){
+    lists[i].assign(triangles.begin() + bounds[i], triangles.begin() + bounds[i+1]);
+  }
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+  for(int i = 0; i < 5; i++){
+    ::coalesce(pool, lists[i]);
+  }
+  triangles.clear();
+  for(int i = 0; i < 5; i++){
+    bounds[i] = triangles.size();
+    triangles.insert(triangles.end(), lists[i].begin(), lists[i].end());
+  }
+  bounds[5] = triangles.size();
+  first[AONLY] = bounds[0];
+  first[BONLY] = last[AONLY] = bounds[1];
+  first[AUNIONB] = last[BONLY] = bounds[2];
+  first[APLUSB] = first[BNOTA] = last[AUNIONB] = bounds[3];
+  first[ANOTB] = last[BNOTA] = bounds[4];
+  last[ANOTB] = last[APLUSB] = bounds[5];
+}
+
+//classifies both surfaces against the other tree at once, each cut into
+//shards spread over threads threads (0 for one per core). triangles
+//away from where the operands meet are sorted beforehand without
+//walking the trees
+CSGResult merge_trees(const BSP_tree* A, const BSP_tree* B, int threads){
+  return merge_trees(A, B, threads, false);
+}
+
+//like merge_trees(A, B, threads), coalescing the fragments of every
+//result if coalesce is set
+CSGResult merge_trees(const BSP_tree* A, const BSP_tree* B, int threads, bool coalesce){
+#ifdef OPENMP
+  if(threads <= 0)
+    threads = omp_get_max_threads();
+#endif
+  //split points go into copies of the pools, leaving the trees as they are
+  std::vector<Vector3> A_vertices(A->vertices), B_vertices(B->vertices);
+  std::vector<Triangle> A_list, B_list;
   traverse(A, A_list);
   traverse(B, B_list);
-  std::vector<TreeTriangle>B_out, B_in;
-  insert(A, B_list, B_in, B_out);
-
-  std::vector<TreeTriangle>A_out, A_in;
-  insert(B, A_list, A_in, A_out);
-  
-  std::vector<TreeTriangle> Apb;
-  Apb.insert(Apb.end(), A_out.begin(), A_out.end());
-  Apb.insert(Apb.end(), B_out.begin(), B_out.end());
-  std::vector<TreeTriangle> Aub;
-  Aub.insert(Aub.end(), A_in.begin(), A_in.end());
-  Aub.insert(Aub.end(), B_in.begin(), B_in.end());
-  
-  //  list[0] = A_in;
-  list[AONLY] = A_list;
-  list[BONLY] = B_list;
-  list[ANOTB] = A_out;
-  list[BNOTA] = B_out;
-  list[AUNIONB] = Aub;
-  list[APLUSB] = Apb;
-  return list;
-  
-}
-
-std::vector<TreeTriangle>* merge_trees(std::vector<TreeTriangle> A_list, std::vector<TreeTriangle> B_list,
-				       BSP_tree *A, BSP_tree * B){
-  std::vector<TreeTriangle> * list = new std::vector<TreeTriangle>[6];
-  std::vector<TreeTriangle>B_out, B_in;
-  insert(A, B_list, B_in, B_out);
-
-  std::vector<TreeTriangle>A_out, A_in;
-  insert(B, A_list, A_in, A_out);
-
-  B_in.insert(B_in.end(), A_in.begin(), A_in.end());
-  //  list[0] = A_in;
-  list[0] = A_out;
-  list[1] = B_in;
-  list[2] = B_out;
-  return list;
-  
+  std::vector<Triangle> A_rest(A_list), B_rest(B_list);
+  std::vector<Triangle> B_out, B_in, A_out, A_in;
+  cull(A, A_list, bounds(B), B_vertices, B_rest, B_in, B_out);
+  cull(B, B_list, bounds(A), A_vertices, A_rest, A_in, A_out);
+  std::vector<Shard> shards;
+  shard(A, B_vertices, B_rest, true, true, threads, shards);
+  size_t B_shards = shards.size();
+  shard(B, A_vertices, A_rest, true, true, threads, shards);
+  run(shards, threads);
+
+  join(shards, 0, B_shards, B_vertices, B_in, B_out);
+  join(shards, B_shards, shards.size(), A_vertices, A_in, A_out);
+
+  CSGResult result;
+  result.assign(A_vertices, A_list, A_in, A_out, B_vertices, B_list, B_in, B_out);
+  if(coalesce)
+    result.coalesce(threads);
+  return result;
+}
+
+CSGResult merge_trees(const BSP_tree* A, const BSP_tree* B){
+  return merge_trees(A, B, 1);
+}
+
+//like merge_trees(A, B), with the surfaces given as lists rather than
+//taken from the trees
+CSGResult merge_trees(const std::vector<TreeTriangle>& A_list,
+		      const std::vector<TreeTriangle>& B_list,
+		      const BSP_tree* A, const BSP_tree* B){
+  std::vector<Vector3> A_vertices, B_vertices;
+  std::vector<Triangle> A_triangles, B_triangles;
+  pool(A_list, A_vertices, A_triangles);
+  pool(B_list, B_vertices, B_triangles);
+  std::vector<Triangle>B_out, B_in;
+  insert(A, B_vertices, B_triangles, B_in, B_out);
+  std::vector<Triangle>A_out, A_in;
+  insert(B, A_vertices, A_triangles, A_in, A_out);
+
+  CSGResult result;
+  result.assign(A_vertices, A_triangles, A_in, A_out, B_vertices, B_triangles, B_in, B_out);
+  return result;
 }
@@ -1,44 +1,242 @@
 #ifndef _TJS_BSPTREE
 #define _TJS_BSPTREE
 #include "math/vector.hpp"
+#include "math/matrix.hpp"
+#include "bsptree/mesh.hpp"
 #include <vector>
+#include <map>
 enum render_type{AONLY, BONLY, ANOTB, BNOTA, AUNIONB, APLUSB, DEFAULT};
+//boolean operations on solids, DIFFERENCE being A minus B
+enum csg_type{CSG_UNION, CSG_INTERSECTION, CSG_DIFFERENCE};
+
+//points closer to a plane than this count as lying on it
+#define EPSILON 1e-3
+
+//implicit plane Ax + By + Cz + D = 0, with (A,B,C) the unit normal
+struct Plane{
+  Vector3 normal;
+  float d;
+  Plane();
+  Plane(const Vector3& a, const Vector3& b, const Vector3& c);
+  //positive in front of the plane, negative behind it
+  inline float f(const Vector3& p) const {return dot(normal, p) + d;}
+};
+
+//axis aligned box, empty while lo is above hi
+struct Bounds{
+  Vector3 lo;
+  Vector3 hi;
+  Bounds();
+  void include(const Vector3& p);
+  void include(const Bounds& b);
+  //the tests count anything within slack of the box as touching it
+  inline bool overlaps(const Bounds& b, float slack) const {
+    return lo.x <= b.hi.x + slack && b.lo.x <= hi.x + slack &&
+      lo.y <= b.hi.y + slack && b.lo.y <= hi.y + slack &&
+      lo.z <= b.hi.z + slack && b.lo.z <= hi.z + slack;
+  }
+  inline bool contains(const Vector3& p, float slack) const {
+    return lo.x <= p.x + slack && p.x <= hi.x + slack &&
+      lo.y <= p.y + slack && p.y <= hi.y + slack &&
+      lo.z <= p.z + slack && p.z <= hi.z + slack;
+  }
+};
 
 struct TreeTriangle{
   Vector3 vertices[3];
   TreeTriangle();
   TreeTriangle(Vector3 a, Vector3 b, Vector3 c);
   Vector3 normal();
+  Plane plane() const;
 };
 
+//child index standing for a missing subtree: a missing front child is
+//outside the model, a missing back child is inside it
+#define BSP_NULL 0xffffffffu
+//child indices standing for a leaf known to be inside or outside the
+//model whichever side of its parent it is on, left by merge where a
+//cell changes sides
+#define BSP_IN 0xfffffffeu
+#define BSP_OUT 0xfffffffdu
+
+//true if child is a node rather than one of the leaves above
+inline bool is_node(unsigned int child){return child < BSP_OUT;}
+//true if the leaf child, on the back or front of its parent, is inside
+inline bool leaf_inside(unsigned int child, bool back){
+  return child == BSP_IN || (child == BSP_NULL && back);
+}
+
+struct BSP_node{
+  //indices into the vertex pool of the tree
+  Triangle triangle;
+  //cached plane of triangle, computed once when the node is created
+  Plane plane;
+  unsigned int front;
+  unsigned int back;
+  unsigned int parent;
+  //set once the triangle is no longer on the surface, the node then
+  //only splitting space
+  bool hidden;
+  //box around the triangles of the subtree rooted here
+  Bounds bounds;
+  BSP_node();
+  BSP_node(const Triangle& t, const Plane& plane, unsigned int parent);
+  inline float f(const Vector3& p) const {return plane.f(p);}
+};
+
+//identifies the point where the edge between two pool vertices crosses
+//the plane of a node, so every triangle sharing that edge reuses it
+struct SplitKey{
+  unsigned int a;
+  unsigned int b;
+  unsigned int plane;
+  SplitKey(unsigned int u, unsigned int v, unsigned int plane);
+  bool operator<(const SplitKey& rhs) const;
+};
+typedef std::map<SplitKey, unsigned int> SplitCache;
+
+//a triangle waiting at a node of the tree
+typedef std::pair<unsigned int, Triangle> PendingTriangle;
+
+//settings of the top-down builder. at each node it tries candidates
+//triangles as the splitting plane, classifying sample_size of the
+//triangles reaching the node against each (0 for all of them), and keeps
+//the one with the lowest
+//  split_weight * spanning + balance_weight * |front - back|
+//so raising split_weight trades a deeper tree for fewer fragments.
+//subtrees with more than grain_size triangles on both sides of their
+//parent are built in parallel on threads threads (0 for one per core,
+//1 to build serially)
+struct BuildOptions{
+  unsigned int candidates;
+  unsigned int sample_size;
+  float split_weight;
+  float balance_weight;
+  int threads;
+  size_t grain_size;
+  BuildOptions();
+};
+
+//the whole tree lives in one contiguous pool of nodes linked by index,
+//with the root at index 0, so it is freed in one go with the tree.
+//node triangles index a shared vertex pool holding the input points
+//followed by every point created by a split
 struct BSP_tree{
-  TreeTriangle triangle;
-  BSP_tree * front;
-  BSP_tree * back;
-  BSP_tree *parent;
+  std::vector<Vector3> vertices;
+  std::vector<BSP_node> nodes;
+  //split points already made while adding triangles
+  SplitCache split_cache;
   BSP_tree();
   BSP_tree(TreeTriangle t);
+  void reserve(size_t n);
+  unsigned int add_vertex(const Vector3& p);
+  unsigned int create_node(const Triangle& t, unsigned int parent);
+  TreeTriangle triangle(unsigned int node) const;
   void add(TreeTriangle t);
   void add(std::vector<TreeTriangle> to_add);
-  float f(Vector3 p);
-  inline bool isempty(){return this == NULL;}
-
+  template<class Iterator> void add(Iterator first, Iterator last);
+  void add_indexed(const Triangle& t);
+  void add_indexed(std::vector<Triangle>& to_add);
+  void build(std::vector<Triangle>& list, const BuildOptions& options);
+  void bound();
+  void apply_transform(const _462::Matrix4& transform);
+  inline bool isempty() const {return nodes.empty();}
+  inline size_t size() const {return nodes.size();}
+ private:
+  //work lists of add_indexed, kept so adding a triangle does not
+  //allocate once they have grown
+  std::vector<PendingTriangle> pending;
+  std::vector<Triangle> pieces;
 };
 
+//adds the TreeTriangles in [first, last) one at a time, each costing a
+//descent of the tree
+template<class Iterator>
+void BSP_tree::add(Iterator first, Iterator last){
+  for(; first != last; ++first){
+    add(*first);
+  }
+}
 
 
-template<class T>
-void swap(T& a, T& b);
 
-Vector3 intersect(Vector3 n, Vector3 p0, Vector3 a, Vector3 c);
+//the fragments of every result of merge_trees, held in one arena: a
+//vertex pool shared by both surfaces and one array of triangles laid
+//out as A, B, A in B, B in A, B out of A, A out of B, so each
+//render_type is one contiguous span of it. it can be moved but not
+//copied, and frees everything when it goes away
+class CSGResult{
+ public:
+  CSGResult();
+  CSGResult(CSGResult&& other);
+  CSGResult& operator=(CSGResult&& other);
+  CSGResult(const CSGResult&) = delete;
+  CSGResult& operator=(const CSGResult&) = delete;
+  //takes over the pools of A and B, which the lists index
+  void assign(std::vector<Vector3>& A_vertices, const std::vector<Triangle>& A_list,
+	      const std::vector<Triangle>& A_in, const std::vector<Triangle>& A_out,
+	      std::vector<Vector3>& B_vertices, const std::vector<Triangle>& B_list,
+	      const std::vector<Triangle>& B_in, const std::vector<Triangle>& B_out);
+  //the triangles of op, indexing vertices()
+  const Triangle* begin(render_type op) const;
+  const Triangle* end(render_type op) const;
+  size_t size(render_type op) const;
+  TreeTriangle triangle(render_type op, size_t i) const;
+  inline const std::vector<Vector3>& vertices() const {return pool;}
+  //runs coalesce over each list of the arena, on threads threads (0 for
+  //one per core)
+  void coalesce(int threads);
+ private:
+  std::vector<Vector3> pool;
+  std::vector<Triangle> triangles;
+  size_t first[DEFAULT];
+  size_t last[DEFAULT];
+};
+
+//volume, surface area, centroid and inertia tensor about the centroid
+//of a solid of unit density
+struct MassProperties{
+  double volume;
+  double area;
+  Vector3 centroid;
+  double inertia[3][3];
+  MassProperties();
+};
+
+Vector3 intersect(const Vector3& a, const Vector3& c, float fa, float fc);
 BSP_tree * create_tree(std::vector<TreeTriangle> triangles);
-std::vector<TreeTriangle>* merge_trees(BSP_tree* A, BSP_tree* B);
-std::vector<TreeTriangle>* merge_trees(std::vector<TreeTriangle>,
-				       std::vector<TreeTriangle>,
-				       BSP_tree* A, BSP_tree* B);
-void traverse(BSP_tree* node, std::vector<TreeTriangle> &list);
-void traverse(BSP_tree* node);
-void insert(const BSP_tree*, const std::vector<TreeTriangle>, std::vector<TreeTriangle>&,
+BSP_tree * create_tree(const Mesh& mesh);
+BSP_tree * create_tree(const Mesh& mesh, const BuildOptions& options);
+unsigned int depth(const BSP_tree* tree);
+BSP_tree * merge(const BSP_tree* A, const BSP_tree* B, csg_type op);
+BSP_tree * merge(const BSP_tree* A, const BSP_tree* B, const std::vector<Triangle>& B_surface,
+		 csg_type op);
+//the calls taking threads run on that many, 0 or less meaning one per
+//core
+CSGResult merge_trees(const BSP_tree* A, const BSP_tree* B);
+CSGResult merge_trees(const BSP_tree* A, const BSP_tree* B, int threads);
+CSGResult merge_trees(const BSP_tree* A, const BSP_tree* B, int threads, bool coalesce);
+//just the list of op, the others left empty
+CSGResult merge_trees(const BSP_tree* A, const BSP_tree* B, render_type op);
+CSGResult merge_trees(const BSP_tree* A, const BSP_tree* B, render_type op, int threads);
+bool point_inside(const BSP_tree* tree, const Vector3& p);
+void classify_points(const BSP_tree* tree, const Vector3* points, size_t n,
+		     unsigned char* inside, int threads);
+bool intersects(const BSP_tree* A, const BSP_tree* B);
+MassProperties mass_properties(const BSP_tree* A, const BSP_tree* B, csg_type op,
+			       int threads);
+CSGResult merge_trees(const std::vector<TreeTriangle>& A_list,
+		      const std::vector<TreeTriangle>& B_list,
+		      const BSP_tree* A, const BSP_tree* B);
+void coalesce(const std::vector<Vector3>& vertices, std::vector<Triangle>& triangles);
+void traverse(const BSP_tree* tree, std::vector<TreeTriangle> &list);
+void traverse(const BSP_tree* tree, std::vector<Triangle> &list);
+void traverse(const BSP_tree* tree);
+void insert(const BSP_tree*, const std::vector<TreeTriangle>&, std::vector<TreeTriangle>&,
 	    std::vector<TreeTriangle>&);
+void insert(const BSP_tree*, std::vector<Vector3>&, const std::vector<Triangle>&,
+	    std::vector<Triangle>&, std::vector<Triangle>&);
+void insert(const BSP_tree*, std::vector<Vector3>&, const std::vector<Triangle>&,
+	    csg_type op, bool first, std::vector<Triangle>&, std::vector<Triangle>&);
 
 #endif
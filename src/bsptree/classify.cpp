@@ -0,0 +1,138 @@
+#include "classify.hpp"
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CLASSIFY_X86
+#include <immintrin.h>
+#endif
+
+//the coordinates of the corners of a run of points or triangles
+struct Corners{
+  const float* x[3];
+  const float* y[3];
+  const float* z[3];
+  int count;
+};
+
+static void classify_scalar(const Plane& plane, float epsilon, const Corners& c,
+			    size_t start, size_t n, unsigned char* sides)
+{
+  const Vector3& normal = plane.normal;
+  for(size_t i = start; i < n; i++){
+    unsigned char s = COPLANAR;
+    for(int k = 0; k < c.count; k++){
+      float f = normal.x*c.x[k][i] + normal.y*c.y[k][i] + normal.z*c.z[k][i] + plane.d;
+      s |= (f >= epsilon ? FRONT : 0) | (f <= -epsilon ? BACK : 0);
+    }
+    sides[i] = s;
+  }
+}
+
+#ifdef CLASSIFY_X86
+//spread[m] has byte k set to bit k of m, turning a lane mask into one
+//byte per lane
+static unsigned long long spread[256];
+
+static void fill_spread(){
+  for(int m = 0; m < 256; m++){
+    unsigned long long bytes = 0;
+    for(int k = 0; k < 8; k++){
+      bytes |= (unsigned long long)((m >> k) & 1) << (8*k);
+    }
+    spread[m] = bytes;
+  }
+}
+
+__attribute__((target("sse2")))
+static void classify_sse(const Plane& plane, float epsilon, const Corners& c,
+			 size_t start, size_t n, unsigned char* sides)
+{
+  const __m128 nx = _mm_set1_ps(plane.normal.x);
+  const __m128 ny = _mm_set1_ps(plane.normal.y);
+  const __m128 nz = _mm_set1_ps(plane.normal.z);
+  const __m128 d = _mm_set1_ps(plane.d);
+  const __m128 front = _mm_set1_ps(epsilon);
+  const __m128 back = _mm_set1_ps(-epsilon);
+  size_t i = start;
+  for(; i + 4 <= n; i += 4){
+    int f_mask = 0, b_mask = 0;
+    for(int k = 0; k < c.count; k++){
+      __m128 f = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, _mm_loadu_ps(c.x[k]+i)),
+				       _mm_mul_ps(ny, _mm_loadu_ps(c.y[k]+i))),
+			    _mm_add_ps(_mm_mul_ps(nz, _mm_loadu_ps(c.z[k]+i)), d));
+      f_mask |= _mm_movemask_ps(_mm_cmpge_ps(f, front));
+      b_mask |= _mm_movemask_ps(_mm_cmple_ps(f, back));
+    }
+    unsigned int bytes = (unsigned int)(spread[f_mask] | (spread[b_mask] << 1));
+    memcpy(sides+i, &bytes, 4);
+  }
+  classify_scalar(plane, epsilon, c, i, n, sides);
+}
+
+__attribute__((target("avx2")))
+static void classify_avx2(const Plane& plane, float epsilon, const Corners& c,
+			  size_t start, size_t n, unsigned char* sides)
+{
+  const __m256 nx = _mm256_set1_ps(plane.normal.x);
+  const __m256 ny = _mm256_set1_ps(plane.normal.y);
+  const __m256 nz = _mm256_set1_ps(plane.normal.z);
+  const __m256 d = _mm256_set1_ps(plane.d);
+  const __m256 front = _mm256_set1_ps(epsilon);
+  const __m256 back = _mm256_set1_ps(-epsilon);
+  size_t i = start;
+  for(; i + 8 <= n; i += 8){
+    int f_mask = 0, b_mask = 0;
+    for(int k = 0; k < c.count; k++){
+      __m256 f = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, _mm256_loadu_ps(c.x[k]+i)),
+					     _mm256_mul_ps(ny, _mm256_loadu_ps(c.y[k]+i))),
+			       _mm256_add_ps(_mm256_mul_ps(nz, _mm256_loadu_ps(c.z[k]+i)), d));
+      f_mask |= _mm256_movemask_ps(_mm256_cmp_ps(f, front, _CMP_GE_OQ));
+      b_mask |= _mm256_movemask_ps(_mm256_cmp_ps(f, back, _CMP_LE_OQ));
+    }
+    unsigned long long bytes = spread[f_mask] | (spread[b_mask] << 1);
+    memcpy(sides+i, &bytes, 8);
+  }
+  //the tail runs on the legacy encoded scalar code, which stalls on
+  //dirty upper halves of the ymm registers
+  _mm256_zeroupper();
+  classify_scalar(plane, epsilon, c, i, n, sides);
+}
+#endif
+
+typedef void (*Kernel)(const Plane&, float, const Corners&, size_t, size_t,
+		       unsigned char*);
+
+//picks the widest kernel the cpu supports, once
+static Kernel select_kernel(){
+#ifdef CLASSIFY_X86
+  fill_spread();
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2"))
+    return classify_avx2;
+  if(__builtin_cpu_supports("sse2"))
+    return classify_sse;
+#endif
+  return classify_scalar;
+}
+
+static const Kernel kernel = select_kernel();
+
+void classify_points(const Plane& plane, float epsilon, const float* x,
+		     const float* y, const float* z, size_t n, unsigned char* sides)
+{
+  Corners c;
+  c.x[0] = x; c.y[0] = y; c.z[0] = z;
+  c.count = 1;
+  kernel(plane, epsilon, c, 0, n, sides);
+}
+
+void classify_triangles(const Plane& plane, float epsilon, const TriangleBlock& block,
+			size_t n, unsigned char* sides)
+{
+  Corners c;
+  for(int k = 0; k < 3; k++){
+    c.x[k] = block.x[k]; c.y[k] = block.y[k]; c.z[k] = block.z[k];
+  }
+  c.count = 3;
+  kernel(plane, epsilon, c, 0, n, sides);
+}
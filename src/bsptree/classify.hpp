@@ -0,0 +1,31 @@
+#ifndef _TJS_CLASSIFY
+#define _TJS_CLASSIFY
+#include "bsptree/bsptree.hpp"
+
+//which side of a plane a point or triangle lies on, as bits: a
+//triangle with vertices on both sides spans the plane
+enum Side{COPLANAR = 0, FRONT = 1, BACK = 2, SPANNING = FRONT | BACK};
+
+#define BLOCK_SIZE 256
+
+//triangles stored as structure of arrays, so a whole block can be
+//classified a few lanes at a time: x[k][i] is the x coordinate of
+//vertex k of triangle i
+struct TriangleBlock{
+  float x[3][BLOCK_SIZE];
+  float y[3][BLOCK_SIZE];
+  float z[3][BLOCK_SIZE];
+};
+
+//sides[i] gets the side of the plane point (x[i], y[i], z[i]) is on,
+//points closer to it than epsilon counting as coplanar. uses AVX2 or SSE
+//when the cpu running it has them
+void classify_points(const Plane& plane, float epsilon, const float* x,
+		     const float* y, const float* z, size_t n, unsigned char* sides);
+
+//sides[i] gets the side of the plane triangle i of block is on, for
+//the first n triangles
+void classify_triangles(const Plane& plane, float epsilon, const TriangleBlock& block,
+			size_t n, unsigned char* sides);
+
+#endif
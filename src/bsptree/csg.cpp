@@ -0,0 +1,322 @@
+#include "csg.hpp"
+#include <algorithm>
+#ifdef OPENMP
+#include <omp.h>
+#endif
+
+unsigned int CSGExpression::operand(const Mesh* mesh){
+  Term t;
+  t.op = CSG_UNION;
+  t.a = t.b = 0;
+  t.mesh = mesh;
+  t.tree = NULL;
+  terms.push_back(t);
+  return terms.size()-1;
+}
+
+unsigned int CSGExpression::operand(const BSP_tree* tree){
+  Term t;
+  t.op = CSG_UNION;
+  t.a = t.b = 0;
+  t.mesh = NULL;
+  t.tree = tree;
+  terms.push_back(t);
+  return terms.size()-1;
+}
+
+//a and b have to be terms already, so operations always come after
+//their operands
+unsigned int CSGExpression::apply(csg_type op, unsigned int a, unsigned int b){
+  Term t;
+  t.op = op;
+  t.a = a;
+  t.b = b;
+  t.mesh = NULL;
+  t.tree = NULL;
+  terms.push_back(t);
+  return terms.size()-1;
+}
+
+//terms are evaluated a level at a time, a level holding the terms whose
+//operands are all on the levels below. the trees of operations are
+//freed as soon as every operation using them is done
+BSP_tree* CSGExpression::evaluate(unsigned int term, int threads) const
+{
+#ifdef OPENMP
+  if(threads <= 0)
+    threads = omp_get_max_threads();
+#endif
+  //operations come after their operands, so going down from term visits
+  //every user of a term before the term itself
+  std::vector<bool> needed(term+1, false);
+  std::vector<unsigned int> uses(term+1, 0), level(term+1, 0);
+  needed[term] = true;
+  for(unsigned int i = term+1; i-- > 0;){
+    const Term& t = terms[i];
+    if(!needed[i] || t.mesh || t.tree)
+      continue;
+    needed[t.a] = needed[t.b] = true;
+    uses[t.a]++;
+    uses[t.b]++;
+  }
+  unsigned int levels = 0;
+  for(unsigned int i = 0; i <= term; i++){
+    const Term& t = terms[i];
+    if(needed[i] && !t.mesh && !t.tree)
+      level[i] = std::max(level[t.a], level[t.b]) + 1;
+    levels = std::max(levels, level[i] + 1);
+  }
+
+  std::vector<const BSP_tree*> value(term+1, (const BSP_tree*)NULL);
+  std::vector<BSP_tree*> made(term+1, (BSP_tree*)NULL);
+  BuildOptions options;
+  options.threads = 1;
+  std::vector<unsigned int> current;
+  for(unsigned int l = 0; l < levels; l++){
+    current.clear();
+    for(unsigned int i = 0; i <= term; i++){
+      if(needed[i] && level[i] == l)
+	current.push_back(i);
+    }
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+    for(int k = 0; k < (int)current.size(); k++){
+      unsigned int i = current[k];
+      const Term& t = terms[i];
+      if(t.tree){
+	value[i] = t.tree;
+	continue;
+      }
+      if(t.mesh)
+	made[i] = create_tree(*t.mesh, options);
+      else
+	made[i] = merge(value[t.a], value[t.b], t.op);
+      value[i] = made[i];
+    }
+    for(size_t k = 0; k < current.size(); k++){
+      const Term& t = terms[current[k]];
+      if(t.mesh || t.tree)
+	continue;
+      unsigned int operands[2] = {t.a, t.b};
+      for(int j = 0; j < 2; j++){
+	unsigned int o = operands[j];
+	if(--uses[o] == 0){
+	  delete made[o];
+	  made[o] = NULL;
+	}
+      }
+    }
+  }
+  if(made[term])
+    return made[term];
+  return new BSP_tree(*value[term]);
+}
+
+Placement::Placement():rotation(_462::Quaternion::Identity()), translation(0, 0, 0){}
+
+Placement::Placement(const _462::Quaternion& rotation, const Vector3& translation):
+  rotation(rotation), translation(translation){}
+
+PreparedOperand::PreparedOperand(const Mesh& mesh, const BuildOptions& options):
+  operand(create_tree(mesh, options)){
+  prepare();
+}
+
+PreparedOperand::PreparedOperand(const BSP_tree& tree):operand(new BSP_tree(tree)){
+  prepare();
+}
+
+PreparedOperand::~PreparedOperand(){
+  delete operand;
+}
+
+void PreparedOperand::prepare(){
+  traverse(operand, surface);
+  exterior = false;
+  if(operand->isempty())
+    return;
+  box = operand->nodes[0].bounds;
+  exterior = point_inside(operand, box.hi + Vector3(1.0, 1.0, 1.0));
+}
+
+//the copy is moved with apply_transform, the nodes keeping their
+//links and triangles
+BSP_tree* PreparedOperand::place(const Placement& placement) const{
+  BSP_tree* placed = new BSP_tree();
+  placed->vertices = operand->vertices;
+  placed->nodes = operand->nodes;
+  _462::Matrix4 transform;
+  _462::make_transformation_matrix(&transform, placement.translation, placement.rotation,
+				   Vector3(1.0, 1.0, 1.0));
+  placed->apply_transform(transform);
+  return placed;
+}
+
+BSP_tree* PreparedOperand::apply(const BSP_tree* workpiece, csg_type op,
+				 const Placement& placement) const{
+  if(op != CSG_UNION && !exterior && !workpiece->isempty() && !operand->isempty()){
+    //the box of the corners of the box, placed
+    Bounds moved;
+    for(int k = 0; k < 8; k++){
+      moved.include(placement * Vector3(k & 1 ? box.hi.x : box.lo.x,
+					k & 2 ? box.hi.y : box.lo.y,
+					k & 4 ? box.hi.z : box.lo.z));
+    }
+    if(!moved.overlaps(workpiece->nodes[0].bounds, 2*EPSILON)){
+      if(op == CSG_INTERSECTION)
+	return new BSP_tree();
+      return new BSP_tree(*workpiece);
+    }
+  }
+  BSP_tree* placed = place(placement);
+  BSP_tree* result = merge(workpiece, placed, surface, op);
+  delete placed;
+  return result;
+}
+
+//each workpiece is merged on one thread, the placed copies of the
+//operand living only as long as their merge
+std::vector<BSP_tree*> PreparedOperand::apply(const std::vector<const BSP_tree*>& workpieces,
+					      csg_type op,
+					      const std::vector<Placement>& placements,
+					      int threads) const{
+#ifdef OPENMP
+  if(threads <= 0)
+    threads = omp_get_max_threads();
+#endif
+  std::vector<BSP_tree*> results;
+  if(placements.size() != workpieces.size())
+    return results;
+  results.resize(workpieces.size(), (BSP_tree*)NULL);
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+  for(int i = 0; i < (int)workpieces.size(); i++){
+    results[i] = apply(workpieces[i], op, placements[i]);
+  }
+  return results;
+}
+
+CSGSession::CSGSession(const BSP_tree* A, const BSP_tree* B, csg_type op):
+  A(A), B_start(new BSP_tree(*B)), B(new BSP_tree(*B)), op(op), pool(A->vertices),
+  whole(0), slot(A->size(), BSP_NULL), marks(A->size(), 0), exterior(false){
+  if(!B_start->isempty())
+    exterior = point_inside(B_start, B_start->nodes[0].bounds.hi + Vector3(1.0, 1.0, 1.0));
+  for(unsigned int n = 0; n < A->size(); n++){
+    if(!A->nodes[n].hidden)
+      keep_whole(n);
+  }
+  set_transform(_462::Matrix4::Identity());
+}
+
+CSGSession::~CSGSession(){
+  delete B_start;
+  delete B;
+}
+
+//puts the triangle of node into the whole part of the result, if it
+//belongs to the result while clear of B
+void CSGSession::keep_whole(unsigned int node){
+  if(exterior != (op == CSG_INTERSECTION))
+    return;
+  result.resize(whole);
+  node_of.resize(whole);
+  result.push_back(A->nodes[node].triangle);
+  node_of.push_back(node);
+  slot[node] = whole++;
+}
+
+//takes the triangle of node out of the whole part, filling its place
+//with the last one
+void CSGSession::drop_whole(unsigned int node){
+  unsigned int at = slot[node];
+  if(at == BSP_NULL)
+    return;
+  whole--;
+  result[at] = result[whole];
+  node_of[at] = node_of[whole];
+  slot[node_of[at]] = at;
+  slot[node] = BSP_NULL;
+  result.resize(whole);
+  node_of.resize(whole);
+}
+
+//marks are 1 for the nodes B met last time, 2 for those it meets only
+//now and 3 for those it still meets
+void CSGSession::set_transform(const _462::Matrix4& transform){
+  B->vertices = B_start->vertices;
+  B->nodes = B_start->nodes;
+  B->apply_transform(transform);
+  result.resize(whole);
+
+  std::vector<unsigned int> next;
+  if(!A->isempty() && !B->isempty()){
+    const Bounds& box = B->nodes[0].bounds;
+    std::vector<unsigned int> stack(1, 0);
+    while(!stack.empty()){
+      const BSP_node& node = A->nodes[stack.back()];
+      unsigned int n = stack.back();
+      stack.pop_back();
+      if(!node.bounds.overlaps(box, 2*EPSILON))
+	continue;
+      if(!node.hidden){
+	Bounds b;
+	for(int j = 0; j < 3; j++){
+	  b.include(A->vertices[node.triangle.vertices[j]]);
+	}
+	if(box.overlaps(b, 2*EPSILON)){
+	  next.push_back(n);
+	  marks[n] = marks[n] ? 3 : 2;
+	}
+      }
+      if(is_node(node.front)) stack.push_back(node.front);
+      if(is_node(node.back)) stack.push_back(node.back);
+    }
+  }
+  for(size_t i = 0; i < affected.size(); i++){
+    unsigned int n = affected[i];
+    if(marks[n] == 1){
+      marks[n] = 0;
+      keep_whole(n);
+    }
+  }
+  for(size_t i = 0; i < next.size(); i++){
+    unsigned int n = next[i];
+    if(marks[n] == 2)
+      drop_whole(n);
+    marks[n] = 1;
+  }
+  affected.swap(next);
+
+  //the split points of the last update go, the whole triangles of A
+  //only ever indexing its own vertices
+  pool.resize(A->vertices.size());
+  std::vector<Triangle> list, inside, outside;
+  list.reserve(affected.size());
+  for(size_t i = 0; i < affected.size(); i++){
+    list.push_back(A->nodes[affected[i]].triangle);
+  }
+  insert(B, pool, list, op, true, inside, outside);
+  const std::vector<Triangle>& A_kept = op == CSG_INTERSECTION ? inside : outside;
+  result.insert(result.end(), A_kept.begin(), A_kept.end());
+
+  //B is taken as apply_transform left it, which turns the triangles
+  //round under a mirror
+  unsigned int base = pool.size();
+  pool.insert(pool.end(), B->vertices.begin(), B->vertices.end());
+  list.clear();
+  traverse(B, list);
+  for(size_t i = 0; i < list.size(); i++){
+    for(int j = 0; j < 3; j++){
+      list[i].vertices[j] += base;
+    }
+  }
+  inside.clear();
+  outside.clear();
+  insert(A, pool, list, op, false, inside, outside);
+  const std::vector<Triangle>& B_kept = op == CSG_UNION ? outside : inside;
+  for(size_t i = 0; i < B_kept.size(); i++){
+    Triangle t = B_kept[i];
+    //the difference keeps the inside of B turned inside out
+    if(op == CSG_DIFFERENCE)
+      std::swap(t.vertices[1], t.vertices[2]);
+    result.push_back(t);
+  }
+}
@@ -0,0 +1,124 @@
+#ifndef _TJS_CSG
+#define _TJS_CSG
+#include "bsptree/bsptree.hpp"
+#include "math/quaternion.hpp"
+#include <vector>
+
+//a boolean expression over solids such as (A u B) - (C n D), evaluated
+//bottom up with merge so no intermediate result is flattened and
+//rebuilt. terms are referred to by the index operand or apply returns
+//for them and may be used by several operations, in which case they
+//are evaluated once and kept until the last of those is done, the faces
+//such terms bring into several merges coming out once as merge keeps a
+//face its operands share. terms whose operands are ready are evaluated
+//in parallel
+class CSGExpression{
+ public:
+  //a mesh or tree to combine, which must outlive the expression
+  unsigned int operand(const Mesh* mesh);
+  unsigned int operand(const BSP_tree* tree);
+  //the result of op on terms a and b
+  unsigned int apply(csg_type op, unsigned int a, unsigned int b);
+  //builds the tree of term on threads threads (0 for one per core).
+  //the tree is new and belongs to the caller
+  BSP_tree* evaluate(unsigned int term, int threads) const;
+  inline size_t size() const {return terms.size();}
+ private:
+  struct Term{
+    csg_type op;
+    unsigned int a;
+    unsigned int b;
+    const Mesh* mesh;
+    const BSP_tree* tree;
+  };
+  std::vector<Term> terms;
+};
+
+//a rigid motion, turning by rotation about the origin and then moving
+//by translation
+struct Placement{
+  _462::Quaternion rotation;
+  Vector3 translation;
+  Placement();
+  Placement(const _462::Quaternion& rotation, const Vector3& translation);
+  inline Vector3 operator*(const Vector3& p) const {return rotation*p + translation;}
+};
+
+//a solid such as a cutter applied to many others at different
+//placements. its tree, surface and box are made once, so each use only
+//moves a copy of the tree, which is linear and splits nothing, rather
+//than building one and flattening it again. a placement whose box
+//misses the other solid skips the tree altogether
+class PreparedOperand{
+ public:
+  PreparedOperand(const Mesh& mesh, const BuildOptions& options);
+  explicit PreparedOperand(const BSP_tree& tree);
+  ~PreparedOperand();
+  PreparedOperand(const PreparedOperand&) = delete;
+  PreparedOperand& operator=(const PreparedOperand&) = delete;
+  //the tree of the operand moved by placement, new and belonging to
+  //the caller
+  BSP_tree* place(const Placement& placement) const;
+  //workpiece op the operand at placement, like merge
+  BSP_tree* apply(const BSP_tree* workpiece, csg_type op, const Placement& placement) const;
+  //apply on every workpiece at the placement with the same index, on
+  //threads threads (0 for one per core). gives no results at all unless
+  //there are as many placements as workpieces
+  std::vector<BSP_tree*> apply(const std::vector<const BSP_tree*>& workpieces, csg_type op,
+			       const std::vector<Placement>& placements, int threads) const;
+  inline const BSP_tree* tree() const {return operand;}
+ private:
+  void prepare();
+  BSP_tree* operand;
+  std::vector<Triangle> surface;
+  Bounds box;
+  //whether the space around the box is inside the model
+  bool exterior;
+};
+
+//a boolean of a fixed A and a B that keeps moving, such as A - B with B
+//dragged around. the triangles of A away from B are kept whole from
+//one update to the next, only those whose box meets the box of B
+//where it now is being pushed through it again, while B, all of which
+//moves, is pushed through A afresh each time. the triangles of A left
+//behind by B go back to being whole. A must outlive the session, B is
+//copied
+class CSGSession{
+ public:
+  CSGSession(const BSP_tree* A, const BSP_tree* B, csg_type op);
+  ~CSGSession();
+  CSGSession(const CSGSession&) = delete;
+  CSGSession& operator=(const CSGSession&) = delete;
+  //moves B to transform, taken from where B was when the session
+  //started, and brings the result up to date
+  void set_transform(const _462::Matrix4& transform);
+  //the triangles of the result, indexing vertices()
+  inline const std::vector<Triangle>& triangles() const {return result;}
+  inline const std::vector<Vector3>& vertices() const {return pool;}
+  //how many triangles of A the last update pushed through B
+  inline size_t touched() const {return affected.size();}
+ private:
+  void keep_whole(unsigned int node);
+  void drop_whole(unsigned int node);
+  const BSP_tree* A;
+  BSP_tree* B_start;
+  BSP_tree* B;
+  csg_type op;
+  //A's vertices followed by those of B where it is and the split points
+  //of the last update
+  std::vector<Vector3> pool;
+  //the whole triangles of A come first in result, node_of giving the
+  //node of each and slot the place of a node's triangle, or BSP_NULL
+  std::vector<Triangle> result;
+  size_t whole;
+  std::vector<unsigned int> node_of;
+  std::vector<unsigned int> slot;
+  //nodes of A whose triangle meets the box of B, flagged in marks
+  std::vector<unsigned int> affected;
+  std::vector<unsigned char> marks;
+  //whether the space around B is inside it, which decides what the
+  //whole triangles of A are
+  bool exterior;
+};
+
+#endif
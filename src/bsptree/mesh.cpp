@@ -5,6 +5,11 @@
 #include <fstream>
 #include <sstream>
 #include <map>
+#include <unordered_map>
+#include <cmath>
+#ifdef OPENMP
+#include <omp.h>
+#endif
 
 struct TriIndex
 {
@@ -47,7 +52,13 @@ Mesh::~Mesh() {
 
 bool Mesh::load()
 {
-    std::cout << "Loading mesh from '" << filename << "'..." << std::endl;
+    return load( std::cout, std::cerr );
+}
+
+//load, writing progress to out and errors to err
+bool Mesh::load( std::ostream& out, std::ostream& err )
+{
+    out << "Loading mesh from '" << filename << "'..." << std::endl;
 
     std::string line;
     std::ifstream file( filename.c_str() );
@@ -82,7 +93,7 @@ bool Mesh::load()
     VertexMap vertex_map;
 
     if ( !file.is_open() ) {
-        std::cout << "Error opening file '" << filename << "' for mesh loading.\n";
+        out << "Error opening file '" << filename << "' for mesh loading.\n";
         return false;
     }
 
@@ -98,7 +109,7 @@ bool Mesh::load()
             stream >> position.x >> position.y >> position.z;
 
             if ( stream.fail() ) {
-                std::cerr << "position syntax error on line " << line_num << std::endl;
+                err << "position syntax error on line " << line_num << std::endl;
                 return false;
             }
 
@@ -109,7 +120,7 @@ bool Mesh::load()
             stream >> normal.x >> normal.y >> normal.z;
 
             if( stream.fail() ) {
-                std::cerr << "normal syntax error on line " << line_num << std::endl;
+                err << "normal syntax error on line " << line_num << std::endl;
                 return false;
             }
             normal_list.push_back( normal );
@@ -120,7 +131,7 @@ bool Mesh::load()
             stream >> uv.x >> uv.y;
 
             if ( stream.fail() ) {
-                std::cerr << "uv syntax error on line " << line_num << std::endl;
+                err << "uv syntax error on line " << line_num << std::endl;
                 return false;
             }
 
@@ -160,7 +171,7 @@ bool Mesh::load()
             num_vertex = face_tokens.size();
 
             if ( num_vertex > 4 || num_vertex < 3 ) {
-                std::cerr << "Syntax error at line " << line_num
+                err << "Syntax error at line " << line_num
                           << ", face has incorrect number of vertices" << std::endl;
                 return false;
             }
@@ -201,7 +212,7 @@ bool Mesh::load()
                     break;
 
                 default:
-                    std::cerr << "Syntax error, unrecongnized face format at line "
+                    err << "Syntax error, unrecongnized face format at line "
                               << line_num << std::endl;
                     break;
                 }
@@ -259,7 +270,7 @@ bool Mesh::load()
     }
     
     calculate_normals();
-    std::cout << "Successfully loaded mesh '" << filename << "'.\n";
+    out << "Successfully loaded mesh '" << filename << "'.\n";
     return true;
 }
 
@@ -310,3 +321,124 @@ MeshData::~MeshData(){
   delete [] vertices;
   delete [] triangles;
 }
+
+WeldOptions::WeldOptions():tolerance(1e-5), smooth(false), threads(0){}
+
+//key of the cell (x, y, z) of the weld grid. far apart cells may share
+//a key, which only costs a comparison
+static inline unsigned long long cell_key(long long x, long long y, long long z){
+  return ((unsigned long long)(x & 0x1fffff) << 42) |
+    ((unsigned long long)(y & 0x1fffff) << 21) | (unsigned long long)(z & 0x1fffff);
+}
+
+//turns triangles indexing points, such as the fragments of a boolean,
+//into an indexed mesh in data, replacing whatever it held. corners
+//are welded through a hash grid of cells a few times the tolerance
+//across, so a corner is compared against the vertices of the cell it
+//is in and only rarely a neighbour. the face normals are computed and
+//the arrays filled in parallel, the welding itself going in order so
+//the result is the same on any number of threads
+void weld(const std::vector<Vector3>& points, const Triangle* first, const Triangle* last,
+	  const WeldOptions& options, MeshData& data)
+{
+  int threads = options.threads;
+#ifdef OPENMP
+  if(threads <= 0)
+    threads = omp_get_max_threads();
+#endif
+  long n = last - first;
+  //face normals, each as long as twice the area of its triangle
+  std::vector<Vector3> faces(n);
+#pragma omp parallel for num_threads(threads)
+  for(long i = 0; i < n; i++){
+    const Triangle& t = first[i];
+    const Vector3& a = points[t.vertices[0]];
+    faces[i] = cross(points[t.vertices[1]] - a, points[t.vertices[2]] - a);
+  }
+
+  float tolerance = options.tolerance;
+  float size = 4*std::max(tolerance, 1e-12f);
+  //the vertices so far, chained through next from the first in their
+  //cell. normals holds the facing of a flat vertex, or the sum of the
+  //face normals around a smooth one
+  std::unordered_map<unsigned long long, unsigned int> cells;
+  cells.reserve(3*n);
+  std::vector<Vector3> positions, normals;
+  std::vector<unsigned int> next;
+  std::vector<unsigned int> corners(3*n);
+  //the vertex each point went into last, so corners sharing a point
+  //skip the grid
+  std::vector<unsigned int> last_vertex(points.size(), (unsigned int)-1);
+  for(long i = 0; i < n; i++){
+    float area = length(faces[i]);
+    Vector3 facing = area > 0 ? faces[i]/area : Vector3::Zero();
+    for(int k = 0; k < 3; k++){
+      unsigned int index = first[i].vertices[k];
+      const Vector3& p = points[index];
+      unsigned int found = last_vertex[index];
+      if(found != (unsigned int)-1 &&
+	 (options.smooth || dot(normals[found], facing) > 0.9999f)){
+	if(options.smooth)
+	  normals[found] += faces[i];
+	corners[3*i+k] = found;
+	continue;
+      }
+      found = (unsigned int)-1;
+      long long lo[3], hi[3];
+      for(int j = 0; j < 3; j++){
+	lo[j] = (long long)floor((p[j] - tolerance)/size);
+	hi[j] = (long long)floor((p[j] + tolerance)/size);
+      }
+      for(long long x = lo[0]; x <= hi[0] && found == (unsigned int)-1; x++)
+	for(long long y = lo[1]; y <= hi[1] && found == (unsigned int)-1; y++)
+	  for(long long z = lo[2]; z <= hi[2] && found == (unsigned int)-1; z++){
+	    std::unordered_map<unsigned long long, unsigned int>::const_iterator it =
+	      cells.find(cell_key(x, y, z));
+	    if(it == cells.end())
+	      continue;
+	    for(unsigned int v = it->second; v != (unsigned int)-1; v = next[v]){
+	      if(length(positions[v] - p) <= tolerance &&
+		 (options.smooth || dot(normals[v], facing) > 0.9999f)){
+		found = v;
+		break;
+	      }
+	    }
+	  }
+      if(found == (unsigned int)-1){
+	found = positions.size();
+	positions.push_back(p);
+	normals.push_back(options.smooth ? Vector3::Zero() : facing);
+	std::pair<std::unordered_map<unsigned long long, unsigned int>::iterator, bool> rv =
+	  cells.insert(std::make_pair(cell_key((long long)floor(p[0]/size),
+					       (long long)floor(p[1]/size),
+					       (long long)floor(p[2]/size)), found));
+	next.push_back(rv.second ? (unsigned int)-1 : rv.first->second);
+	rv.first->second = found;
+      }
+      if(options.smooth)
+	normals[found] += faces[i];
+      corners[3*i+k] = found;
+      last_vertex[index] = found;
+    }
+  }
+
+  delete [] data.vertices;
+  delete [] data.triangles;
+  long m = positions.size();
+  data.num_vertices = m;
+  data.num_triangles = n;
+  data.vertices = new Vertex[m];
+  data.triangles = new Triangle[n];
+#pragma omp parallel for num_threads(threads)
+  for(long v = 0; v < m; v++){
+    float len = length(normals[v]);
+    data.vertices[v].position = positions[v];
+    data.vertices[v].normal = len > 0 ? normals[v]/len : Vector3::Zero();
+  }
+#pragma omp parallel for num_threads(threads)
+  for(long i = 0; i < n; i++){
+    for(int k = 0; k < 3; k++){
+      data.triangles[i].vertices[k] = corners[3*i+k];
+    }
+  }
+}
@@ -3,6 +3,7 @@
 
 #include "math/vector.hpp"
 #include <vector>
+#include <iosfwd>
 #include <cassert>
 
 struct Vertex
@@ -30,6 +31,7 @@ struct Mesh
   std::string filename;
   void calculate_normals();
   bool load();
+  bool load(std::ostream& out, std::ostream& err);
   void translate(Vector3 t);
   void scale(float s);
 
@@ -55,4 +57,20 @@ struct MeshData
   ~MeshData();
 };
 
+//settings of weld. corners closer than tolerance become one vertex.
+//with smooth set a vertex is shared by every triangle around it and
+//gets the area weighted mean of their normals, otherwise only triangles
+//facing the same way share vertices, so each facet stays flat. the
+//arrays are filled on threads threads (0 for one per core)
+struct WeldOptions
+{
+  float tolerance;
+  bool smooth;
+  int threads;
+  WeldOptions();
+};
+
+void weld(const std::vector<Vector3>& points, const Triangle* first, const Triangle* last,
+	  const WeldOptions& options, MeshData& data);
+
 #endif
@@ -0,0 +1,285 @@
+/*
+ * bsp_batch: runs a file of csg jobs without opening a window.
+ *
+ * usage: bsp_batch [-j threads] [-c] [-s] jobfile
+ *
+ * every line of the job file is one job
+ *
+ *   meshA meshB operation tx ty tz [ax ay az degrees [scale]] output
+ *
+ * where operation is union, intersection or difference and output is
+ * the obj file the result is written to. meshB is scaled by scale
+ * (default 1, which has to be positive), turned by degrees about the
+ * axis (ax, ay, az) through the origin (default no turn) and moved by
+ * (tx, ty, tz). blank lines and lines starting with '#' are skipped.
+ *
+ * -j runs the jobs on that many threads (default one per core), -c
+ * merges coplanar fragments of each result before it is written and
+ * -s writes smooth instead of flat normals.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "bsptree/mesh.hpp"
+#include "bsptree/bsptree.hpp"
+#include "bsptree/csg.hpp"
+#ifdef OPENMP
+#include <omp.h>
+#endif
+
+struct Job{
+  int line;
+  std::string A, B, output;
+  csg_type op;
+  //where meshB goes, scaled by scale about the origin first
+  Placement placement;
+  float scale;
+  //indices into the mesh and tree caches
+  unsigned int A_mesh, B_mesh;
+};
+
+static double seconds(){
+  return std::chrono::duration<double>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool parse_op(const std::string& name, csg_type& op){
+  if(name == "union") op = CSG_UNION;
+  else if(name == "intersection") op = CSG_INTERSECTION;
+  else if(name == "difference") op = CSG_DIFFERENCE;
+  else return false;
+  return true;
+}
+
+static const char* op_name(csg_type op){
+  switch(op){
+  case CSG_UNION: return "union";
+  case CSG_INTERSECTION: return "intersection";
+  default: return "difference";
+  }
+}
+
+static bool read_jobs(const char* filename, std::vector<Job>& jobs){
+  std::ifstream file(filename);
+  if(!file.is_open()){
+    std::cerr << "Error opening job file '" << filename << "'.\n";
+    return false;
+  }
+  std::string line, word;
+  int line_num = 0;
+  while(getline(file, line)){
+    line_num++;
+    size_t start = line.find_first_not_of(" \t\r");
+    if(start == std::string::npos || line[start] == '#')
+      continue;
+    std::stringstream stream(line);
+    std::vector<std::string> words;
+    while(stream >> word)
+      words.push_back(word);
+    //the numbers between the operation and the output
+    size_t n = words.size() < 4 ? 0 : words.size() - 4;
+    double value[8] = {0, 0, 0, 0, 0, 1, 0, 1};
+    bool ok = n == 3 || n == 7 || n == 8;
+    for(size_t i = 0; ok && i < n; i++){
+      char* end;
+      value[i] = strtod(words[3+i].c_str(), &end);
+      ok = *end == '\0';
+    }
+    if(!ok || value[7] <= 0.0 || Vector3(value[3], value[4], value[5]) == Vector3::Zero()){
+      std::cerr << "job syntax error on line " << line_num << std::endl;
+      return false;
+    }
+    Job job;
+    job.line = line_num;
+    job.A = words[0];
+    job.B = words[1];
+    job.output = words.back();
+    job.placement = Placement(_462::Quaternion(Vector3(value[3], value[4], value[5]),
+					       value[6] * PI / 180.0),
+			      Vector3(value[0], value[1], value[2]));
+    job.scale = value[7];
+    const std::string& op = words[2];
+    if(!parse_op(op, job.op)){
+      std::cerr << "unknown operation '" << op << "' on line " << line_num
+		<< std::endl;
+      return false;
+    }
+    jobs.push_back(job);
+  }
+  return true;
+}
+
+//writes data as an obj with one normal per vertex
+static bool write_obj(const std::string& filename, const MeshData& data){
+  FILE* file = fopen(filename.c_str(), "w");
+  if(!file)
+    return false;
+  for(size_t i = 0; i < data.num_vertices; i++){
+    const Vector3& p = data.vertices[i].position;
+    fprintf(file, "v %g %g %g\n", p.x, p.y, p.z);
+  }
+  for(size_t i = 0; i < data.num_vertices; i++){
+    const Vector3& n = data.vertices[i].normal;
+    fprintf(file, "vn %g %g %g\n", n.x, n.y, n.z);
+  }
+  for(size_t i = 0; i < data.num_triangles; i++){
+    const unsigned int* v = data.triangles[i].vertices;
+    fprintf(file, "f %u//%u %u//%u %u//%u\n",
+	    v[0]+1, v[0]+1, v[1]+1, v[1]+1, v[2]+1, v[2]+1);
+  }
+  return fclose(file) == 0;
+}
+
+static void usage(const char* name){
+  std::cerr << "usage: " << name << " [-j threads] [-c] [-s] jobfile\n";
+}
+
+int main(int argc, char **argv){
+  int threads = 0;
+  bool coalesce_result = false;
+  WeldOptions weld_options;
+  const char* job_file = NULL;
+  for(int i = 1; i < argc; i++){
+    if(!strcmp(argv[i], "-j") && i+1 < argc) threads = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "-c")) coalesce_result = true;
+    else if(!strcmp(argv[i], "-s")) weld_options.smooth = true;
+    else if(argv[i][0] != '-' && !job_file) job_file = argv[i];
+    else{
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if(!job_file){
+    usage(argv[0]);
+    return 1;
+  }
+#ifdef OPENMP
+  if(threads <= 0) threads = omp_get_max_threads();
+#endif
+  if(threads <= 0) threads = 1;
+
+  std::vector<Job> jobs;
+  if(!read_jobs(job_file, jobs))
+    return 1;
+
+  //every mesh the jobs need, each loaded and built into a tree once no
+  //matter how many jobs use it or where they put it
+  std::map<std::string, unsigned int> mesh_ids;
+  std::vector<std::string> mesh_files;
+  for(size_t i = 0; i < jobs.size(); i++){
+    for(int side = 0; side < 2; side++){
+      const std::string& file = side ? jobs[i].B : jobs[i].A;
+      if(!mesh_ids.count(file)){
+	mesh_ids[file] = mesh_files.size();
+	mesh_files.push_back(file);
+      }
+      (side ? jobs[i].B_mesh : jobs[i].A_mesh) = mesh_ids[file];
+    }
+  }
+
+  //what Mesh::load has to say is printed a mesh at a time, so the
+  //threads don't write over each other
+  double start = seconds();
+  std::vector<Mesh*> meshes(mesh_files.size(), (Mesh*)NULL);
+  bool loaded = true;
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+  for(int i = 0; i < (int)meshes.size(); i++){
+    Mesh* mesh = new Mesh();
+    mesh->filename = mesh_files[i];
+    std::ostringstream out, err;
+    bool ok = mesh->load(out, err);
+#pragma omp critical
+    {
+      std::cout << out.str() << std::flush;
+      std::cerr << err.str() << std::flush;
+      if(!ok)
+	loaded = false;
+    }
+    meshes[i] = mesh;
+  }
+  if(!loaded){
+    for(size_t i = 0; i < meshes.size(); i++) delete meshes[i];
+    return 1;
+  }
+  double load_time = seconds() - start;
+
+  //the surface of each tree, as merge wants it for its second operand.
+  //placing a tree keeps its triangles where they are in the nodes, and
+  //without a mirror their winding too, so the surface fits it anywhere
+  start = seconds();
+  std::vector<BSP_tree*> trees(meshes.size(), (BSP_tree*)NULL);
+  std::vector<std::vector<Triangle> > surfaces(meshes.size());
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+  for(int i = 0; i < (int)trees.size(); i++){
+    BuildOptions options;
+    options.threads = 1;
+    trees[i] = create_tree(*meshes[i], options);
+    traverse(trees[i], surfaces[i]);
+  }
+  double build_time = seconds() - start;
+  printf("%zu meshes loaded in %.3fs, %zu trees built in %.3fs\n",
+	 meshes.size(), load_time, trees.size(), build_time);
+  fflush(stdout);
+
+  //each job runs alone on one thread, so the pool never holds more
+  //than threads results at once, and welds on that thread too rather
+  //than starting threads of its own
+  weld_options.threads = 1;
+  start = seconds();
+  int failed = 0;
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+  for(int i = 0; i < (int)jobs.size(); i++){
+    const Job& job = jobs[i];
+    double t0 = seconds();
+    const BSP_tree* B = trees[job.B_mesh];
+    BSP_tree* placed = NULL;
+    _462::Matrix4 transform;
+    _462::make_transformation_matrix(&transform, job.placement.translation,
+				     job.placement.rotation,
+				     Vector3(job.scale, job.scale, job.scale));
+    if(transform != _462::Matrix4::Identity()){
+      placed = new BSP_tree(*B);
+      placed->apply_transform(transform);
+      B = placed;
+    }
+    BSP_tree* result = merge(trees[job.A_mesh], B, surfaces[job.B_mesh], job.op);
+    delete placed;
+    std::vector<Triangle> triangles;
+    traverse(result, triangles);
+    if(coalesce_result)
+      coalesce(result->vertices, triangles);
+    double t1 = seconds();
+    MeshData data;
+    weld(result->vertices, triangles.data(), triangles.data() + triangles.size(),
+	 weld_options, data);
+    delete result;
+    bool written = write_obj(job.output, data);
+    double t2 = seconds();
+#pragma omp critical
+    {
+      if(!written){
+	failed++;
+	fprintf(stderr, "job %d: could not write '%s'\n", job.line,
+		job.output.c_str());
+      }
+      printf("job %d: %s %s %s -> %s  %zu triangles  csg %.3fs  write %.3fs\n",
+	     job.line, job.A.c_str(), op_name(job.op), job.B.c_str(),
+	     job.output.c_str(), data.num_triangles, t1 - t0, t2 - t1);
+      fflush(stdout);
+    }
+  }
+  printf("%zu jobs on %d threads in %.3fs, %d failed\n",
+	 jobs.size(), threads, seconds() - start, failed);
+
+  for(size_t i = 0; i < trees.size(); i++) delete trees[i];
+  for(size_t i = 0; i < meshes.size(); i++) delete meshes[i];
+  return failed ? 1 : 0;
+}
@@ -19,6 +19,8 @@
 #include <GL/glu.h>
 #include "bsptree/mesh.hpp"
 #include "bsptree/bsptree.hpp"
+#include "math/matrix.hpp"
+#include "math/quaternion.hpp"
 #include "SDL.h"
 
 /* screen width, height, and bit depth */
@@ -33,6 +35,9 @@
 #define ASSERT(condition){if(!(condition)){std::cerr<<"ASSERTION FAILED: "<<#condition<<"@"<<__FILE__<<"("<<__LINE__<<")"<<std::endl;}}
 
 
+/* how far one key press moves the second model */
+#define MOVE_STEP 0.1
+
 /* This is our SDL surface */
 SDL_Surface *surface;
 
@@ -60,10 +65,8 @@ static GLfloat ry, rx;
 //MeshData BnA;
 //MeshData AUB;
 
-std::vector<TreeTriangle> * merged;
+CSGResult merged;
 
-std::vector<TreeTriangle> t1;
-std::vector<TreeTriangle> t2;
 BSP_tree* tree1;
 BSP_tree* tree2;
 
@@ -123,6 +126,8 @@ int resizeWindow( int width, int height )
     return( TRUE );
 }
 
+void move_operand(Vector3 step);
+
 /* function to handle key press events */
 void handleKeyPress( SDL_keysym *keysym )
 {
@@ -149,6 +154,12 @@ void handleKeyPress( SDL_keysym *keysym )
 	case SDLK_UP: ry-= 2; break;
 	case SDLK_RIGHT: rx+= 2; break;
 	case SDLK_LEFT: rx-= 2; break;
+	case SDLK_a: move_operand(Vector3(-MOVE_STEP, 0.0, 0.0)); break;
+	case SDLK_d: move_operand(Vector3(MOVE_STEP, 0.0, 0.0)); break;
+	case SDLK_s: move_operand(Vector3(0.0, -MOVE_STEP, 0.0)); break;
+	case SDLK_w: move_operand(Vector3(0.0, MOVE_STEP, 0.0)); break;
+	case SDLK_q: move_operand(Vector3(0.0, 0.0, -MOVE_STEP)); break;
+	case SDLK_e: move_operand(Vector3(0.0, 0.0, MOVE_STEP)); break;
 	default:
 	    break;
 	}
@@ -369,26 +380,8 @@ void copy_mesh_data(){
 }
 
 void create_bsp(){
-
-  for(int i =0; i < mesh1->triangles.size(); i++){
-    TreeTriangle tri;    
-    for(int j =0; j <3; j++){
-      tri.vertices[j] = mesh1->vertices[mesh1->triangles[i].vertices[j]].position;
-    }
-    t1.push_back(tri);
-  }
-
-  for(int i =0; i < mesh2->triangles.size(); i++){
-    TreeTriangle tri;
-    for(int j =0; j <3; j++){
-      tri.vertices[j] = mesh2->vertices[mesh2->triangles[i].vertices[j]].position;
-    }
-    t2.push_back(tri);
-  }
-
-  tree1 = create_tree(t1);
-  tree2 = create_tree(t2);
-
+  tree1 = create_tree(*mesh1);
+  tree2 = create_tree(*mesh2);
 }
 
 void merge_bsp(){
@@ -398,29 +391,27 @@ void merge_bsp(){
 
 void convert_bsp_to_mesh()
 {
+  WeldOptions options;
   for(int model_idx =0; model_idx < 6; model_idx++){
-    int vert_idx = 0;
-    Vertex * verts;
-    Triangle * triangles;
-    std::vector<TreeTriangle> tri = merged[model_idx];
-    bool_data[model_idx].num_vertices = tri.size()*3;
-    bool_data[model_idx].num_triangles = tri.size();
-    verts = new Vertex[bool_data[model_idx].num_vertices];
-    triangles = new Triangle[bool_data[model_idx].num_triangles];
-    for(int i =0; i <tri.size(); i++){
-      for(int k = 0; k<3; k++){
-	triangles[i].vertices[k] = vert_idx;
-	verts[vert_idx].position = tri[i].vertices[k];
-	verts[vert_idx].normal = tri[i].normal();
-	//	verts[vert_idx].normal *= .5;
-	vert_idx++;
-      }
-	
-    }
-    bool_data[model_idx].triangles = triangles;
-    bool_data[model_idx].vertices = verts;
+    render_type op = (render_type)model_idx;
+    weld(merged.vertices(), merged.begin(op), merged.end(op), options, bool_data[model_idx]);
   }
+}
 
+//moves the second model by step, moving its tree in place rather than
+//building it again, and redoes the boolean results
+void move_operand(Vector3 step)
+{
+  _462::Matrix4 transform;
+  _462::make_transformation_matrix(&transform, step, _462::Quaternion::Identity(),
+				   Vector3(1.0, 1.0, 1.0));
+  tree2->apply_transform(transform);
+  for(size_t i = 0; i < meshdata2->num_vertices; i++){
+    meshdata2->vertices[i].position += step;
+  }
+  loc2 += step;
+  merge_bsp();
+  convert_bsp_to_mesh();
 }
 
 int main( int argc, char **argv )
@@ -0,0 +1,381 @@
+/*
+ * bsp_check: booleans of unit cubes whose results are known exactly,
+ * most of them sharing faces, which is where the classification of a
+ * fragment lying on a plane of the other operand decides the answer,
+ * and the queries and passes over such cubes and their results.
+ *
+ * usage: bsp_check
+ *
+ * prints every case and exits with 1 if any of them is off.
+ */
+
+#include <stdio.h>
+#include <math.h>
+#include <vector>
+#include <utility>
+#include "bsptree/mesh.hpp"
+#include "bsptree/bsptree.hpp"
+#include "bsptree/csg.hpp"
+
+//results are exact up to float rounding
+#define TOLERANCE 1e-4
+
+static int failed = 0;
+
+//a unit cube with its low corner at corner, wound outwards. vertex i
+//is the corner i & 4, i & 2, i & 1 away from it along x, y and z
+static void cube(const Vector3& corner, Mesh& mesh){
+  static const unsigned int faces[12][3] = {
+    {0, 6, 4}, {0, 2, 6}, {0, 3, 2}, {0, 1, 3}, {2, 7, 6}, {2, 3, 7},
+    {4, 6, 7}, {4, 7, 5}, {0, 4, 5}, {0, 5, 1}, {1, 5, 7}, {1, 7, 3}};
+  for(int i = 0; i < 8; i++){
+    Vertex v;
+    v.position = corner + Vector3(i & 4 ? 1.0 : 0.0, i & 2 ? 1.0 : 0.0, i & 1 ? 1.0 : 0.0);
+    mesh.vertices.push_back(v);
+  }
+  for(int i = 0; i < 12; i++){
+    Triangle t;
+    for(int j = 0; j < 3; j++) t.vertices[j] = faces[i][j];
+    mesh.triangles.push_back(t);
+  }
+}
+
+static BSP_tree* cube(const Vector3& corner){
+  Mesh mesh;
+  cube(corner, mesh);
+  return create_tree(mesh);
+}
+
+//volume and area of the surface of tree
+static void measure(const BSP_tree* tree, double& volume, double& area){
+  std::vector<TreeTriangle> list;
+  traverse(tree, list);
+  volume = area = 0.0;
+  for(size_t i = 0; i < list.size(); i++){
+    const Vector3* v = list[i].vertices;
+    volume += dot(v[0], cross(v[1], v[2])) / 6.0;
+    area += length(cross(v[1] - v[0], v[2] - v[0])) / 2.0;
+  }
+}
+
+static void check(const char* name, const BSP_tree* tree, double volume, double area){
+  double v, a;
+  measure(tree, v, a);
+  bool ok = fabs(v - volume) < TOLERANCE && fabs(a - area) < TOLERANCE;
+  if(!ok)
+    failed++;
+  printf("%-24s volume %8.4f (%8.4f)  area %8.4f (%8.4f)  %s\n", name, v, volume,
+	 a, area, ok ? "ok" : "FAILED");
+}
+
+//volume and area of the triangles [first, last) indexing p
+static void measure(const std::vector<Vector3>& p, const Triangle* first, const Triangle* last,
+		    double& volume, double& area){
+  volume = area = 0.0;
+  for(; first != last; ++first){
+    const unsigned int* t = first->vertices;
+    volume += dot(p[t[0]], cross(p[t[1]], p[t[2]])) / 6.0;
+    area += length(cross(p[t[1]] - p[t[0]], p[t[2]] - p[t[0]])) / 2.0;
+  }
+}
+
+//volume and area of the result of session
+static void check(const char* name, const CSGSession& session, double volume, double area){
+  const std::vector<Triangle>& list = session.triangles();
+  double v, a;
+  measure(session.vertices(), list.data(), list.data() + list.size(), v, a);
+  bool ok = fabs(v - volume) < TOLERANCE && fabs(a - area) < TOLERANCE;
+  if(!ok)
+    failed++;
+  printf("%-24s volume %8.4f (%8.4f)  area %8.4f (%8.4f)  %s\n", name, v, volume,
+	 a, area, ok ? "ok" : "FAILED");
+}
+
+//checks that moving tree by transform moves its inside with it, on a
+//grid of points kept clear of the faces of the unit cube
+static void check(const char* name, const BSP_tree* tree, const _462::Matrix4& transform){
+  BSP_tree moved(*tree);
+  moved.apply_transform(transform);
+  int wrong = 0, total = 0;
+  for(int x = 0; x < 20; x++)
+    for(int y = 0; y < 20; y++)
+      for(int z = 0; z < 20; z++){
+	Vector3 p(-0.45 + 0.1*x, -0.45 + 0.1*y, -0.45 + 0.1*z);
+	if(point_inside(tree, p) != point_inside(&moved, transform.transform_point(p)))
+	  wrong++;
+	total++;
+      }
+  if(wrong)
+    failed++;
+  printf("%-24s %d of %d points change sides  %s\n", name, wrong, total,
+	 wrong ? "FAILED" : "ok");
+}
+
+//checks that classify_points agrees with point_inside on a grid of
+//points around the unit cubes, many of them on their faces, spanning
+//several packets
+static void check_points(const char* name, const BSP_tree* tree){
+  std::vector<Vector3> points;
+  for(int x = 0; x <= 20; x++)
+    for(int y = 0; y <= 20; y++)
+      for(int z = 0; z <= 20; z++)
+	points.push_back(Vector3(-0.5 + 0.125*x, -0.5 + 0.125*y, -0.5 + 0.125*z));
+  std::vector<unsigned char> inside(points.size());
+  classify_points(tree, points.data(), points.size(), inside.data(), 0);
+  int wrong = 0, in = 0;
+  for(size_t i = 0; i < points.size(); i++){
+    if((bool)inside[i] != point_inside(tree, points[i]))
+      wrong++;
+    in += inside[i];
+  }
+  if(wrong)
+    failed++;
+  printf("%-24s %d of %zu points disagree, %d inside  %s\n", name, wrong, points.size(),
+	 in, wrong ? "FAILED" : "ok");
+}
+
+//checks intersects both ways round against the expected answer
+static void check_intersects(const char* name, const BSP_tree* A, const BSP_tree* B,
+			     bool expected){
+  bool forward = intersects(A, B), backward = intersects(B, A);
+  bool ok = forward == expected && backward == expected;
+  if(!ok)
+    failed++;
+  printf("%-24s %s %s (%s)  %s\n", name, forward ? "yes" : "no", backward ? "yes" : "no",
+	 expected ? "yes" : "no", ok ? "ok" : "FAILED");
+}
+
+//volume and area of the list op of result
+static void check(const char* name, const CSGResult& result, render_type op, double volume,
+		  double area){
+  double v, a;
+  measure(result.vertices(), result.begin(op), result.end(op), v, a);
+  bool ok = fabs(v - volume) < TOLERANCE && fabs(a - area) < TOLERANCE;
+  if(!ok)
+    failed++;
+  printf("%-24s volume %8.4f (%8.4f)  area %8.4f (%8.4f)  %s\n", name, v, volume,
+	 a, area, ok ? "ok" : "FAILED");
+}
+
+//checks that coalesce keeps the volume and area of the triangles
+//indexing p, gives no more of them and makes none with next to no area
+static void check_coalesce(const char* name, const std::vector<Vector3>& p,
+			   std::vector<Triangle> triangles){
+  double volume, area, v, a;
+  measure(p, triangles.data(), triangles.data() + triangles.size(), volume, area);
+  size_t before = triangles.size();
+  coalesce(p, triangles);
+  measure(p, triangles.data(), triangles.data() + triangles.size(), v, a);
+  int thin = 0;
+  for(size_t i = 0; i < triangles.size(); i++){
+    const unsigned int* t = triangles[i].vertices;
+    Vector3 u = p[t[1]] - p[t[0]], w = p[t[2]] - p[t[1]];
+    if(length(cross(u, w)) <= 1e-6 * length(u) * length(w))
+      thin++;
+  }
+  bool ok = fabs(v - volume) < TOLERANCE && fabs(a - area) < TOLERANCE &&
+    triangles.size() <= before && thin == 0;
+  if(!ok)
+    failed++;
+  printf("%-24s volume %8.4f (%8.4f)  area %8.4f (%8.4f)  %zu -> %zu, %d thin  %s\n",
+	 name, v, volume, a, area, before, triangles.size(), thin, ok ? "ok" : "FAILED");
+}
+
+//checks the vertex and triangle counts weld gives the surface of tree
+//with every corner a point of its own
+static void check_weld(const char* name, const BSP_tree* tree, bool smooth,
+		       size_t vertices, size_t triangles){
+  std::vector<TreeTriangle> list;
+  traverse(tree, list);
+  std::vector<Vector3> points;
+  std::vector<Triangle> unshared(list.size());
+  for(size_t i = 0; i < list.size(); i++){
+    for(int j = 0; j < 3; j++){
+      unshared[i].vertices[j] = points.size();
+      points.push_back(list[i].vertices[j]);
+    }
+  }
+  WeldOptions options;
+  options.smooth = smooth;
+  MeshData data;
+  weld(points, unshared.data(), unshared.data() + unshared.size(), options, data);
+  bool ok = data.num_vertices == vertices && data.num_triangles == triangles;
+  if(!ok)
+    failed++;
+  printf("%-24s %zu vertices (%zu)  %zu triangles (%zu)  %s\n", name, data.num_vertices,
+	 vertices, data.num_triangles, triangles, ok ? "ok" : "FAILED");
+}
+
+//checks merge and mass_properties of A op B against the expected
+//volume and area
+static void check(const char* name, const BSP_tree* A, const BSP_tree* B, csg_type op,
+		  double volume, double area){
+  BSP_tree* result = merge(A, B, op);
+  check(name, result, volume, area);
+  delete result;
+  MassProperties mass = mass_properties(A, B, op, 1);
+  bool ok = fabs(mass.volume - volume) < TOLERANCE && fabs(mass.area - area) < TOLERANCE;
+  if(!ok){
+    failed++;
+    printf("%-24s mass_properties volume %8.4f area %8.4f  FAILED\n", name, mass.volume,
+	   mass.area);
+  }
+}
+
+//a session of A with a moving copy of itself, checked in place, slid
+//onto B and mirrored onto B
+static void check_session(const char* name, const BSP_tree* A, csg_type op,
+			  const _462::Matrix4& slide, const _462::Matrix4& mirror,
+			  double volume, double area, double moved_volume, double moved_area){
+  char label[64];
+  CSGSession session(A, A, op);
+  snprintf(label, sizeof(label), "%s in place", name);
+  check(label, session, volume, area);
+  session.set_transform(slide);
+  snprintf(label, sizeof(label), "%s slid", name);
+  check(label, session, moved_volume, moved_area);
+  session.set_transform(mirror);
+  snprintf(label, sizeof(label), "%s mirrored", name);
+  check(label, session, moved_volume, moved_area);
+}
+
+int main(){
+  BSP_tree* A = cube(Vector3(0, 0, 0));
+  //overlapping A by half, sharing parts of four faces with it
+  BSP_tree* B = cube(Vector3(0.5, 0, 0));
+  //touching A across the face x = 1
+  BSP_tree* C = cube(Vector3(1, 0, 0));
+
+  check("A u A", A, A, CSG_UNION, 1.0, 6.0);
+  check("A n A", A, A, CSG_INTERSECTION, 1.0, 6.0);
+  check("A - A", A, A, CSG_DIFFERENCE, 0.0, 0.0);
+  check("A u B", A, B, CSG_UNION, 1.5, 8.0);
+  check("A n B", A, B, CSG_INTERSECTION, 0.5, 4.0);
+  check("A - B", A, B, CSG_DIFFERENCE, 0.5, 4.0);
+  check("A u C", A, C, CSG_UNION, 2.0, 10.0);
+  check("A n C", A, C, CSG_INTERSECTION, 0.0, 0.0);
+  check("A - C", A, C, CSG_DIFFERENCE, 1.0, 6.0);
+
+  //a result merged again with an operand it already holds
+  BSP_tree* AB = merge(A, B, CSG_UNION);
+  check("(A u B) u A", AB, A, CSG_UNION, 1.5, 8.0);
+  check("(A u B) n B", AB, B, CSG_INTERSECTION, 1.0, 6.0);
+  check("(A u B) - B", AB, B, CSG_DIFFERENCE, 0.5, 4.0);
+
+  //the same through an expression, whose shared terms put coincident
+  //faces into the later merges
+  CSGExpression expression;
+  unsigned int a = expression.operand(A);
+  unsigned int b = expression.operand(B);
+  unsigned int a_u_b = expression.apply(CSG_UNION, a, b);
+  unsigned int rest = expression.apply(CSG_DIFFERENCE, a_u_b, a);
+  unsigned int all = expression.apply(CSG_UNION, rest, a_u_b);
+  BSP_tree* result = expression.evaluate(rest, 1);
+  check("(A u B) - A", result, 0.5, 4.0);
+  delete result;
+  result = expression.evaluate(all, 1);
+  check("((A u B) - A) u (A u B)", result, 1.5, 8.0);
+  delete result;
+
+  //both moves put the copy of A where B is
+  _462::Matrix4 slide = _462::Matrix4::Identity();
+  slide(3, 0) = 0.5;
+  _462::Matrix4 mirror = _462::Matrix4::Identity();
+  mirror(0, 0) = -1.0;
+  mirror(3, 0) = 1.5;
+  check_session("session A u B", A, CSG_UNION, slide, mirror, 1.0, 6.0, 1.5, 8.0);
+  check_session("session A n B", A, CSG_INTERSECTION, slide, mirror, 1.0, 6.0, 0.5, 4.0);
+  check_session("session A - B", A, CSG_DIFFERENCE, slide, mirror, 0.0, 0.0, 0.5, 4.0);
+
+  //cubes overlapping, one inside the other, touching across a face
+  //and apart
+  BSP_tree* far = cube(Vector3(3, 0.5, 0));
+  Mesh small;
+  cube(Vector3(0, 0, 0), small);
+  for(size_t i = 0; i < small.vertices.size(); i++){
+    small.vertices[i].position = small.vertices[i].position * 0.5 + Vector3(0.25, 0.25, 0.25);
+  }
+  BSP_tree* inner = create_tree(small);
+  check_intersects("intersects A B", A, B, true);
+  check_intersects("intersects A inner", A, inner, true);
+  check_intersects("intersects A C", A, C, false);
+  check_intersects("intersects A far", A, far, false);
+  delete far;
+  delete inner;
+
+  //the lists of merge_trees, with E overlapping A across a corner and
+  //sharing no face with it. each list that is a closed surface is
+  //checked, through a result that has been moved
+  BSP_tree* E = cube(Vector3(0.5, 0.5, 0.5));
+  CSGResult lists = merge_trees(A, E, 0);
+  CSGResult moved_lists;
+  moved_lists = std::move(lists);
+  check("merge_trees A", moved_lists, AONLY, 1.0, 6.0);
+  check("merge_trees E", moved_lists, BONLY, 1.0, 6.0);
+  check("merge_trees A in E", moved_lists, AUNIONB, 0.125, 1.5);
+  check("merge_trees A out of E", moved_lists, APLUSB, 1.875, 10.5);
+  //the same lists coalesced, and a merged tree's surface coalesced on
+  //its own
+  CSGResult coalesced = merge_trees(A, E, 1, true);
+  check("coalesced A in E", coalesced, AUNIONB, 0.125, 1.5);
+  check("coalesced A out of E", coalesced, APLUSB, 1.875, 10.5);
+  for(int op = ANOTB; op <= APLUSB; op++){
+    if(coalesced.size((render_type)op) > moved_lists.size((render_type)op)){
+      failed++;
+      printf("coalesced list %d grew from %zu to %zu  FAILED\n", op,
+	     moved_lists.size((render_type)op), coalesced.size((render_type)op));
+    }
+  }
+  BSP_tree* AE = merge(A, E, CSG_UNION);
+  std::vector<Triangle> surface;
+  traverse(AE, surface);
+  check_coalesce("coalesce A u E", AE->vertices, surface);
+  delete AE;
+  surface.clear();
+  traverse(AB, surface);
+  check_coalesce("coalesce A u B", AB->vertices, surface);
+
+  if(lists.size(AONLY) != 0 ||
+     moved_lists.size(APLUSB) != moved_lists.size(ANOTB) + moved_lists.size(BNOTA)){
+    failed++;
+    printf("merge_trees lists are laid out wrong  FAILED\n");
+  }
+
+  //a closed cube keeps its 8 corners when smooth, and 4 for each face
+  //when flat
+  check_weld("weld A flat", A, false, 24, 12);
+  check_weld("weld A smooth", A, true, 8, 12);
+
+  check_points("classify_points A", A);
+  check_points("classify_points A u B", AB);
+
+  //a cube with degenerate triangles among its faces, whose nodes get
+  //zero planes, moved in place and elsewhere
+  Mesh mesh;
+  cube(Vector3(0, 0, 0), mesh);
+  Vertex middle;
+  middle.position = Vector3(0.5, 0, 0);
+  mesh.vertices.push_back(middle);
+  //added last, so they go in as leaves anywhere in the tree
+  const unsigned int degenerate[4][3] = {{0, 0, 4}, {0, 8, 4}, {2, 2, 7}, {8, 4, 0}};
+  for(int i = 0; i < 4; i++){
+    Triangle t;
+    for(int j = 0; j < 3; j++) t.vertices[j] = degenerate[i][j];
+    mesh.triangles.insert(mesh.triangles.begin(), t);
+  }
+  BSP_tree* D = create_tree(mesh);
+  _462::Matrix4 moved;
+  _462::make_transformation_matrix(&moved, Vector3(2.0, -1.0, 0.5),
+				   _462::Quaternion(Vector3(0, 0, 1), PI/2), Vector3(1, 1, 1));
+  check("degenerate in place", D, _462::Matrix4::Identity());
+  check("degenerate moved", D, moved);
+  delete D;
+
+  delete E;
+  delete AB;
+  delete A;
+  delete B;
+  delete C;
+  printf("%s\n", failed ? "FAILED" : "all ok");
+  return failed ? 1 : 0;
+}
@@ -162,7 +162,11 @@ void Quaternion::to_matrix( Matrix4* matp ) const
 
 void Quaternion::to_axes( Vector3 axes[3] ) const
 {
-    rotate_axes( *this, &axes[0][0], &axes[1][0], &axes[2][0] );
+    // Vector3 is single precision, so go through real_t
+    real_t ax[3][3];
+    rotate_axes( *this, ax[0], ax[1], ax[2] );
+    for ( int i = 0; i < 3; ++i )
+        axes[i] = Vector3( ax[i][0], ax[i][1], ax[i][2] );
 }
 
 Quaternion normalize( const Quaternion& q )